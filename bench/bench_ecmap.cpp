@@ -0,0 +1,96 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <cstdlib>
+#include "Common.hpp"
+
+// the hasher ecmapinv used before ECSetMap, rotating each element by its position, without the
+// undefined shifts of the original
+struct OldSortedVectorHasher {
+  size_t operator()(const std::vector<int32_t>& v) const {
+    uint64_t r = 0;
+    int i = 0;
+    for (auto x : v) {
+      uint64_t u = (uint32_t) x;
+      r = r ^ ((i == 0) ? u : ((u >> i) | (u << (64-i))));
+      i = (i+1)%64;
+    }
+    return r;
+  }
+};
+
+static void report(const char *name, size_t n, size_t m, std::chrono::steady_clock::duration build,
+                   std::chrono::steady_clock::duration lookup, int64_t found) {
+  std::cout << name << "  build " << n / std::chrono::duration<double>(build).count() / 1e6
+            << " M ECs/s, lookup " << m / std::chrono::duration<double>(lookup).count() / 1e6
+            << " M ECs/s (" << found << " found)" << std::endl;
+}
+
+template <typename Map>
+static void bench_map(const char *name, Map &map, const std::vector<std::vector<int32_t>> &ecs,
+                      const std::vector<std::vector<int32_t>> &queries) {
+  auto t0 = std::chrono::steady_clock::now();
+  map.reserve(ecs.size());
+  for (size_t i = 0; i < ecs.size(); i++) {
+    map.insert({ecs[i], (int32_t) i});
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  int64_t found = 0;
+  for (const auto &q : queries) {
+    found += map.find(q) != map.end();
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  report(name, ecs.size(), queries.size(), t1 - t0, t2 - t1, found);
+}
+
+// times building the EC table and looking up ECs, half of which are in the table, with ECSetMap
+// and with std::unordered_map.
+// usage: bench_ecmap [ecs] [lookups]
+int main(int argc, char **argv) {
+  size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 500000;
+  size_t m = (argc > 2) ? std::strtoull(argv[2], nullptr, 10) : (4ULL << 20);
+  std::mt19937_64 rng(42);
+
+  // ECs of 1 to 13 transcripts, with small sets the most common
+  auto random_ec = [&rng]() {
+    std::vector<int32_t> v(1 + (rng() % 4) * (rng() % 5));
+    for (auto &t : v) {
+      t = (int32_t) (rng() % 200000);
+    }
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+    return v;
+  };
+  std::vector<std::vector<int32_t>> ecs(n);
+  for (auto &v : ecs) {
+    v = random_ec();
+  }
+  std::vector<std::vector<int32_t>> queries(m);
+  for (auto &q : queries) {
+    q = (rng() % 2) ? ecs[rng() % n] : random_ec();
+  }
+
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    ECSetMap map;
+    map.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      map.insert(ecs[i], (int32_t) i);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    int64_t found = 0;
+    for (const auto &q : queries) {
+      found += map.find(q) != -1;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    report("ECSetMap                       ", n, m, t1 - t0, t2 - t1, found);
+  }
+  std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> current;
+  bench_map("unordered_map, hash_ec        ", current, ecs, queries);
+  std::unordered_map<std::vector<int32_t>, int32_t, OldSortedVectorHasher> old;
+  bench_map("unordered_map, previous hasher", old, ecs, queries);
+  return 0;
+}
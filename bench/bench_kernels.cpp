@@ -0,0 +1,147 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "BUSData.h"
+
+// base by base versions of the kernels in BUSData, for comparison
+
+static int hamming_per_base(uint64_t a, uint64_t b, size_t len) {
+  uint64_t df = a^b;
+  int d = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (((df >> (2*i)) & 0x03ULL) != 0) {
+      d++;
+    }
+  }
+  return d;
+}
+
+static void binaryToString_per_base(uint64_t x, size_t len, char *s) {
+  static const char alpha[4] = {'A', 'C', 'G', 'T'};
+  for (size_t i = 0; i < len; i++) {
+    s[i] = alpha[(x >> (2*(len - 1 - i))) & 0x03ULL];
+  }
+}
+
+static uint64_t stringToBinary_per_base(const char *s, size_t len, uint32_t &flag) {
+  uint64_t r = 0;
+  flag = 0;
+  int numN = 0;
+  size_t posN = 0;
+  for (size_t i = 0; i < len && i < 32; ++i) {
+    uint64_t x = (s[i] & 4) >> 1;
+    if ((s[i] & 3) == 2) {
+      if (numN == 0) {
+        posN = i;
+      }
+      ++numN;
+    }
+    r = (r << 2) | (x + ((x ^ (s[i] & 2)) >> 1));
+  }
+  if (numN > 0) {
+    flag = (std::min(numN, 3) & 3) | (posN & 15) << 2;
+  }
+  return r;
+}
+
+// compares the kernels with the base by base versions on lengths that are not a multiple of the
+// word size and on strings with N and other characters, returns the number of disagreements
+static size_t check_kernels(std::mt19937_64 &rng) {
+  const char chars[] = "ACGTacgtNn.-X";
+  const size_t lens[] = {1, 2, 3, 4, 5, 7, 8, 9, 12, 15, 16, 17, 23, 24, 25, 31, 32};
+  size_t bad = 0;
+  char s[32], r[32];
+  for (size_t len : lens) {
+    uint64_t mask = (len == 32) ? ~0ULL : ((1ULL << (2*len)) - 1);
+    for (int it = 0; it < 100000; it++) {
+      // mostly ACGT with a few Ns and other characters at random positions
+      for (size_t i = 0; i < len; i++) {
+        s[i] = (rng() % 8 == 0) ? chars[8 + rng() % 5] : chars[rng() % 8];
+      }
+      uint32_t f1, f2;
+      uint64_t x1 = stringToBinary_per_base(s, len, f1), x2 = stringToBinary(s, len, f2);
+      bad += x1 != x2 || f1 != f2;
+
+      uint64_t x = rng() & mask;
+      uint64_t y = (rng() % 2) ? x ^ (rng() & rng() & rng() & mask) : rng() & mask;
+      bad += hamming(x, y, len) != hamming_per_base(x, y, len);
+
+      binaryToString_per_base(x, len, r);
+      binaryToString(x, len, s);
+      bad += std::memcmp(r, s, len) != 0;
+    }
+  }
+  return bad;
+}
+
+// times hamming distances, decoding and encoding of random 16bp barcodes and reports ns per call.
+// usage: bench_kernels [barcodes]
+int main(int argc, char **argv) {
+  size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : (4ULL << 20);
+  const size_t len = 16;
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> bcs(n);
+  for (auto &x : bcs) {
+    x = rng() & ((1ULL << (2*len)) - 1);
+  }
+  std::vector<char> txt(n*len), ref(n*len);
+
+  if (check_kernels(rng) != 0) {
+    std::cerr << "Error: the kernels disagree with the base by base versions on mixed input" << std::endl;
+    return 1;
+  }
+
+  auto ns = [n](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count() / n;
+  };
+  uint64_t a = 0, b = 0;
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 1; i < n; i++) {
+    a += hamming_per_base(bcs[i], bcs[i-1], len);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  for (size_t i = 1; i < n; i++) {
+    b += hamming(bcs[i], bcs[i-1], len);
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  std::cout << "hamming         " << ns(t1 - t0) << " -> " << ns(t2 - t1) << " ns" << std::endl;
+  bool ok = a == b;
+
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    binaryToString_per_base(bcs[i], len, &ref[i*len]);
+  }
+  t1 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    binaryToString(bcs[i], len, &txt[i*len]);
+  }
+  t2 = std::chrono::steady_clock::now();
+  std::cout << "binaryToString  " << ns(t1 - t0) << " -> " << ns(t2 - t1) << " ns" << std::endl;
+  ok = ok && std::memcmp(txt.data(), ref.data(), txt.size()) == 0;
+
+  a = b = 0;
+  uint32_t f;
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    a += stringToBinary_per_base(&txt[i*len], len, f) + f;
+  }
+  t1 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) {
+    b += stringToBinary(&txt[i*len], len, f) + f;
+  }
+  t2 = std::chrono::steady_clock::now();
+  std::cout << "stringToBinary  " << ns(t1 - t0) << " -> " << ns(t2 - t1) << " ns" << std::endl;
+  ok = ok && a == b;
+
+  if (!ok) {
+    std::cerr << "Error: the kernels disagree with the base by base versions" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdlib>
+#include "BUSData.h"
+#include "bustools_sort.h"
+
+// sorts the same random records with std::sort and with radix_sort and reports records per second.
+// usage: bench_sort [records]
+int main(int argc, char **argv) {
+  size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : (4ULL << 20);
+  std::mt19937_64 rng(42);
+
+  // 16bp barcodes from a set of cells, 12bp UMIs and ECs from a small table
+  std::vector<uint64_t> cells(std::max<size_t>(n / 1000, 1));
+  for (auto &c : cells) {
+    c = rng() & ((1ULL << 32) - 1);
+  }
+  std::vector<BUSData> input(n);
+  for (auto &b : input) {
+    b.barcode = cells[rng() % cells.size()];
+    b.UMI = rng() & ((1ULL << 24) - 1);
+    b.ec = (int32_t) (rng() % 100000);
+    b.count = 1;
+  }
+
+  auto less = [](const BUSData &a, const BUSData &b) {
+    if (a.barcode != b.barcode) {
+      return a.barcode < b.barcode;
+    }
+    if (a.UMI != b.UMI) {
+      return a.UMI < b.UMI;
+    }
+    return a.ec < b.ec;
+  };
+  auto same = [](const BUSData &a, const BUSData &b) {
+    return a.barcode == b.barcode && a.UMI == b.UMI && a.ec == b.ec;
+  };
+
+  std::vector<BUSData> a(input), b(input), tmp(n);
+  auto t0 = std::chrono::steady_clock::now();
+  std::sort(a.begin(), a.end(), less);
+  auto t1 = std::chrono::steady_clock::now();
+  BUSData *r = radix_sort(b.data(), n, tmp.data());
+  auto t2 = std::chrono::steady_clock::now();
+
+  if (!std::equal(a.begin(), a.end(), r, same)) {
+    std::cerr << "Error: radix_sort and std::sort disagree" << std::endl;
+    return 1;
+  }
+  auto rate = [n](std::chrono::steady_clock::duration d) {
+    return n / std::chrono::duration<double>(d).count() / 1e6;
+  };
+  std::cout << "records     " << n << std::endl;
+  std::cout << "std::sort   " << rate(t1 - t0) << " M records/s" << std::endl;
+  std::cout << "radix_sort  " << rate(t2 - t1) << " M records/s" << std::endl;
+  return 0;
+}
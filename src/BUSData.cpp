@@ -1,10 +1,17 @@
 #include "BUSData.h"
+#include "Common.hpp"
 
 #include <cstring>
+#include <cstdio>
 #include <assert.h>
 #include <unordered_map>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 uint64_t stringToBinary(const std::string &s, uint32_t &flag) {
   return stringToBinary(s.c_str(), s.size(), flag);
@@ -12,33 +19,46 @@ uint64_t stringToBinary(const std::string &s, uint32_t &flag) {
 
 std::string binaryToString(uint64_t x, size_t len) {
   std::string s(len, 'N');
-  size_t sh = len-1;
-  for (size_t i = 0; i < len; i++) {
-    char c = 'N';
-    switch((x >> (2*sh)) & 0x03ULL) {
-      case 0x00: c = 'A'; break;
-      case 0x01: c = 'C'; break;
-      case 0x02: c = 'G'; break;
-      case 0x03: c = 'T'; break;
-    }
-    sh--;
-    s.at(i) = c;
-  }
+  binaryToString(x, len, &s[0]);
   return std::move(s);
 }
 
+namespace {
 
-int hamming(uint64_t a, uint64_t b, size_t len) {
-  uint64_t df = a^b;
-  int d = 0;
-  size_t sh = len-1;
-  for (size_t i = 0; i < len; ++i) {
-    if (((df>>(2*sh)) & 0x03ULL) != 0) {
-      d++;
-    }    
-    sh--;
+// the four bases of every byte of a packed sequence, and the code and N flag of every character
+struct BaseTables {
+  char bases[256][4];
+  uint8_t code[256];
+  uint8_t isN[256];
+
+  BaseTables() {
+    for (int b = 0; b < 256; b++) {
+      for (int i = 0; i < 4; i++) {
+        bases[b][i] = alpha[(b >> (2*(3 - i))) & 0x03];
+      }
+    }
+    // A, C, G and T in either case are 0, 1, 2 and 3, other characters are whatever their bits give
+    for (int c = 0; c < 256; c++) {
+      int x = (c & 4) >> 1;
+      code[c] = x + ((x ^ (c & 2)) >> 1);
+      isN[c] = (c & 3) == 2;
+    }
+  }
+};
+
+const BaseTables base_tables;
+
+} // namespace
+
+// writes the len bases of x to s, four at a time
+void binaryToString(uint64_t x, size_t len, char *s) {
+  size_t i = 0;
+  for (; i < len % 4; i++) {
+    s[i] = alpha[(x >> (2*(len - 1 - i))) & 0x03ULL];
+  }
+  for (; i < len; i += 4) {
+    std::memcpy(s + i, base_tables.bases[(x >> (2*(len - 4 - i))) & 0xFF], 4);
   }
-  return d;
 }
 
 uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag) {
@@ -50,17 +70,37 @@ uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag) {
   if (k > 32) {
     k = 32;
   }
-  for (size_t i = 0; i < k; ++i) {
-    uint64_t x = ((*s) & 4) >> 1;
-    if (((*s) & 3) == 2) {
+  size_t i = 0;
+  // eight characters at a time: bits 1 and 2 of each give its code, the codes are then packed
+  // into 16 bits with the first character highest
+  const uint64_t ones = 0x0101010101010101ULL;
+  for (; i + 8 <= k; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, s + i, 8);
+    uint64_t b1 = (w >> 1) & ones;
+    uint64_t b2 = (w >> 2) & ones;
+    uint64_t n = b1 & ~w & ones; // characters with (c & 3) == 2
+    if (n != 0) {
+      if (numN == 0) {
+        posN = i + __builtin_ctzll(n) / 8;
+      }
+      numN += __builtin_popcountll(n);
+    }
+    uint64_t t = __builtin_bswap64((b2 << 1) | (b2 ^ b1));
+    t = (t | (t >> 6)) & 0x000F000F000F000FULL;
+    t = (t | (t >> 12)) & 0x000000FF000000FFULL;
+    t = (t | (t >> 24)) & 0xFFFFULL;
+    r = (r << 16) | t;
+  }
+  for (; i < k; ++i) {
+    uint8_t c = s[i];
+    if (base_tables.isN[c]) {
       if (numN == 0) {
         posN = i;
       }
       ++numN;
     }
-    r = r << 2;
-    r |= (x + ((x ^ (*s & 2)) >>1));
-    s++;
+    r = (r << 2) | base_tables.code[c];
   }
   if (numN>0) {
     if (numN > 3) {
@@ -72,6 +112,8 @@ uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag) {
 }
 
 
+static bool parseHeaderTables(const char *p, const char *end, BUSHeader &header);
+
 bool parseHeader(std::istream &inf, BUSHeader &header) {
   char magic[4];  
   inf.read((char*)(&magic[0]), 4);
@@ -79,50 +121,507 @@ bool parseHeader(std::istream &inf, BUSHeader &header) {
     return false;
   }
   inf.read((char*)(&header.version), sizeof(header.version));
-  if (header.version != BUSFORMAT_VERSION) {
+  if (header.version != BUSFORMAT_VERSION && header.version != BUSFORMAT_VERSION_COLUMNAR) {
     return false;
   }
   inf.read((char*)(&header.bclen), sizeof(header.bclen));
   inf.read((char*)(&header.umilen), sizeof(header.umilen));
   uint32_t tlen = 0;
   inf.read((char*)(&tlen), sizeof(tlen));
-  char* t = new char[tlen+1];
-  inf.read(t, tlen);
+  std::vector<char> t(tlen+1);
+  inf.read(t.data(), tlen);
   t[tlen] = '\0';
-  header.text.assign(t);
-  delete[] t;
+  header.text.assign(t.data());
+
+  // the EC table and transcript names can follow the text after a null character
+  header.transcripts.clear();
+  header.ecs.clear();
+  size_t pos = header.text.size() + 1;
+  if (pos + 12 <= tlen && std::strncmp(&t[pos], "ECT1", 4) == 0) {
+    if (!parseHeaderTables(&t[pos+4], &t[tlen], header)) {
+      std::cerr << "Warning: could not read the EC table in the BUS header" << std::endl;
+      header.transcripts.clear();
+      header.ecs.clear();
+    }
+  }
 
   return true;
 }
 
+// the tables are the number of transcripts and ECs followed by the transcript names and the
+// ECs, each stored as uint32_t offsets into a block of names or int32_t transcript indices
+static void writeHeaderTables(std::string &s, const BUSHeader &header) {
+  auto put = [&s](const void *p, size_t n) { s.append((const char*) p, n); };
+  uint32_t ntx = header.transcripts.size(), nec = header.ecs.size();
+  s.append("ECT1", 4);
+  put(&ntx, sizeof(ntx));
+  put(&nec, sizeof(nec));
+  uint32_t off = 0;
+  put(&off, sizeof(off));
+  for (const auto &t : header.transcripts) {
+    off += t.name.size();
+    put(&off, sizeof(off));
+  }
+  for (const auto &t : header.transcripts) {
+    s.append(t.name);
+  }
+  off = 0;
+  put(&off, sizeof(off));
+  for (auto v : header.ecs) {
+    off += v.size();
+    put(&off, sizeof(off));
+  }
+  for (auto v : header.ecs) {
+    put(v.data(), v.size()*sizeof(int32_t));
+  }
+}
 
+static bool parseHeaderTables(const char *p, const char *end, BUSHeader &header) {
+  uint32_t ntx = 0, nec = 0;
+  std::memcpy(&ntx, p, sizeof(ntx));
+  std::memcpy(&nec, p + 4, sizeof(nec));
+  p += 8;
+  if ((size_t) (end - p) < (ntx + 1)*sizeof(uint32_t)) {
+    return false;
+  }
+  std::vector<uint32_t> off(ntx + 1);
+  std::memcpy(off.data(), p, off.size()*sizeof(uint32_t));
+  p += off.size()*sizeof(uint32_t);
+  if ((size_t) (end - p) < off[ntx]) {
+    return false;
+  }
+  for (uint32_t i = 0; i < ntx; i++) {
+    if (off[i+1] < off[i]) {
+      return false;
+    }
+  }
+  header.transcripts.reserve(ntx);
+  for (uint32_t i = 0; i < ntx; i++) {
+    header.transcripts.emplace_back(std::string(p + off[i], off[i+1] - off[i]));
+  }
+  p += off[ntx];
 
-bool parseECs(const std::string &filename, BUSHeader &header) {
-  auto &ecs = header.ecs; 
-  std::ifstream inf(filename.c_str());
-  std::string line, t;
-  line.reserve(10000);
-  
+  if ((size_t) (end - p) < (nec + 1)*sizeof(uint32_t)) {
+    return false;
+  }
+  off.resize(nec + 1);
+  std::memcpy(off.data(), p, off.size()*sizeof(uint32_t));
+  p += off.size()*sizeof(uint32_t);
+  if ((size_t) (end - p) < off[nec]*sizeof(int32_t)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < nec; i++) {
+    if (off[i+1] < off[i]) {
+      return false;
+    }
+  }
+  std::vector<int32_t> x(off[nec]);
+  std::memcpy(x.data(), p, x.size()*sizeof(int32_t));
+  header.ecs.reserve(nec, x.size());
+  for (uint32_t i = 0; i < nec; i++) {
+    header.ecs.push_back(x.data() + off[i], x.data() + off[i+1]);
+  }
+  return true;
+}
+
+
+
+bool readHeader(const std::string &filename, BUSHeader &header) {
+  std::ifstream inf(filename.c_str(), std::ios::binary);
+  return parseHeader(inf, header);
+}
+
+// reads the ECs into header.ecs and the transcript names from the files ecf and txf, the ones that
+// are not given are taken from the header of the BUS file busf. Returns false if either is missing
+bool parseECsAndTranscripts(const std::string &ecf, const std::string &txf, const std::string &busf, BUSHeader &header, std::unordered_map<std::string, int32_t> &txnames) {
+  if (isECIndex(ecf)) {
+    ECIndex index;
+    if (!parseECIndex(ecf, index)) {
+      return false;
+    }
+    header.ecs = std::move(index.ecs);
+    txnames.clear();
+    for (int32_t i = 0; i < (int32_t) index.transcripts.size(); i++) {
+      txnames.insert({index.transcripts[i], i});
+    }
+    return !header.ecs.empty() && !txnames.empty();
+  }
+  BUSHeader bh;
+  if ((ecf.empty() || txf.empty()) && !busf.empty()) {
+    readHeader(busf, bh);
+  }
+  header.ecs.clear();
+  if (!ecf.empty()) {
+    parseECs(ecf, header);
+  } else {
+    header.ecs = std::move(bh.ecs);
+  }
+  txnames.clear();
+  if (!txf.empty()) {
+    parseTranscripts(txf, txnames);
+  } else {
+    for (int32_t i = 0; i < (int32_t) bh.transcripts.size(); i++) {
+      txnames.insert({bh.transcripts[i].name, i});
+    }
+  }
+  return !header.ecs.empty() && !txnames.empty();
+}
+
+// the index is the magic "BECI" and version followed by the number of ECs, transcripts and genes
+// and then the ECs, the genes of each EC, the gene of each transcript and the transcript and gene
+// names. Sets are stored as uint32_t offsets followed by the int32_t elements and names as uint32_t
+// offsets followed by the characters padded to 4 bytes, so every table is aligned when mapped
+static void writeSets(std::ostream &o, const SetTable &v) {
+  uint32_t off = 0;
+  o.write((char*)(&off), sizeof(off));
+  for (auto s : v) {
+    off += s.size();
+    o.write((char*)(&off), sizeof(off));
+  }
+  for (auto s : v) {
+    o.write((char*) s.data(), s.size()*sizeof(int32_t));
+  }
+}
+
+static void writeNames(std::ostream &o, const std::vector<std::string> &v) {
+  uint32_t off = 0;
+  o.write((char*)(&off), sizeof(off));
+  for (const auto &s : v) {
+    off += s.size();
+    o.write((char*)(&off), sizeof(off));
+  }
+  for (const auto &s : v) {
+    o.write(s.data(), s.size());
+  }
+  o.write("\0\0\0", (4 - off % 4) % 4);
+}
+
+// reads n sets with elements in [lo, hi) at p, advancing p
+static bool readSets(const char *&p, const char *end, uint32_t n, int32_t lo, int32_t hi, SetTable &v) {
+  if ((size_t) (end - p) < ((size_t) n + 1)*sizeof(uint32_t)) {
+    return false;
+  }
+  const uint32_t *off = (const uint32_t*) p;
+  p += ((size_t) n + 1)*sizeof(uint32_t);
+  if (off[0] != 0 || (size_t) (end - p) < off[n]*sizeof(int32_t)) {
+    return false;
+  }
+  const int32_t *x = (const int32_t*) p;
+  for (uint32_t i = 0; i < off[n]; i++) {
+    if (x[i] < lo || x[i] >= hi) {
+      return false;
+    }
+  }
+  v.clear();
+  v.reserve(n, off[n]);
+  for (uint32_t i = 0; i < n; i++) {
+    if (off[i+1] < off[i]) {
+      return false;
+    }
+    v.push_back(x + off[i], x + off[i+1]);
+  }
+  p += off[n]*sizeof(int32_t);
+  return true;
+}
+
+static bool readNames(const char *&p, const char *end, uint32_t n, std::vector<std::string> &v) {
+  if ((size_t) (end - p) < ((size_t) n + 1)*sizeof(uint32_t)) {
+    return false;
+  }
+  const uint32_t *off = (const uint32_t*) p;
+  p += ((size_t) n + 1)*sizeof(uint32_t);
+  if (off[0] != 0 || (size_t) (end - p) < off[n]) {
+    return false;
+  }
+  v.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    if (off[i+1] < off[i]) {
+      return false;
+    }
+    v[i].assign(p + off[i], off[i+1] - off[i]);
+  }
+  p += std::min((size_t) (end - p), ((size_t) off[n] + 3) / 4 * 4);
+  return true;
+}
+
+bool isECIndex(const std::string &filename) {
+  std::ifstream inf(filename.c_str(), std::ios::binary);
+  char magic[4];
+  inf.read(magic, 4);
+  return inf.good() && std::strncmp(magic, "BECI", 4) == 0;
+}
+
+bool writeECIndex(const std::string &filename, const ECIndex &index) {
+  std::ofstream outf(filename, std::ios::binary);
+  uint32_t nec = index.ecs.size(), ntx = index.transcripts.size(), ngenes = index.genes.size();
+  outf.write("BECI", 4);
+  outf.write((char*)(&ECINDEX_VERSION), sizeof(ECINDEX_VERSION));
+  outf.write((char*)(&nec), sizeof(nec));
+  outf.write((char*)(&ntx), sizeof(ntx));
+  outf.write((char*)(&ngenes), sizeof(ngenes));
+  writeSets(outf, index.ecs);
+  writeSets(outf, index.ec2genes);
+  outf.write((char*) index.genemap.data(), ntx*sizeof(int32_t));
+  writeNames(outf, index.transcripts);
+  writeNames(outf, index.genes);
+  return outf.good();
+}
+
+bool parseECIndex(const std::string &filename, ECIndex &index) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 20) {
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  const char *p = (const char*) m, *end = p + st.st_size;
+  uint32_t h[5];
+  std::memcpy(h, p, sizeof(h));
+  p += sizeof(h);
+  uint32_t nec = h[2], ntx = h[3], ngenes = h[4];
+  bool ok = std::strncmp((const char*) m, "BECI", 4) == 0 && h[1] == ECINDEX_VERSION
+    && ntx <= INT32_MAX && ngenes <= INT32_MAX
+    && readSets(p, end, nec, 0, ntx, index.ecs)
+    && readSets(p, end, nec, 0, ngenes, index.ec2genes)
+    && (size_t) (end - p) >= ntx*sizeof(int32_t);
+  if (ok) {
+    index.genemap.assign((const int32_t*) p, (const int32_t*) p + ntx);
+    p += ntx*sizeof(int32_t);
+    for (auto g : index.genemap) {
+      ok = ok && g >= -1 && g < (int32_t) ngenes;
+    }
+    ok = ok && readNames(p, end, ntx, index.transcripts) && readNames(p, end, ngenes, index.genes);
+  }
+  munmap(m, st.st_size);
+  if (!ok) {
+    std::cerr << "Error: " << filename << " is not a valid EC index" << std::endl;
+  }
+  return ok;
+}
+
+// loads the compiled index ecf, or builds the index from the EC, transcript and gene files where
+// the missing ECs and transcript names are taken from the header of the BUS file busf
+bool loadECIndex(const std::string &ecf, const std::string &txf, const std::string &genef, const std::string &busf, ECIndex &index) {
+  if (isECIndex(ecf)) {
+    return parseECIndex(ecf, index);
+  }
+  BUSHeader h;
+  std::unordered_map<std::string, int32_t> txnames;
+  if (!parseECsAndTranscripts(ecf, txf, busf, h, txnames)) {
+    return false;
+  }
+  index.ecs = std::move(h.ecs);
+  index.transcripts.assign(txnames.size(), "");
+  for (const auto &tx : txnames) {
+    if (tx.second >= (int32_t) index.transcripts.size()) {
+      index.transcripts.resize(tx.second + 1);
+    }
+    index.transcripts[tx.second] = tx.first;
+  }
+  index.genemap.assign(index.transcripts.size(), -1);
+  std::unordered_map<std::string, int32_t> genenames;
+  parseGenes(genef, txnames, index.genemap, genenames);
+  index.genes.assign(genenames.size(), "");
+  for (const auto &g : genenames) {
+    index.genes[g.second] = g.first;
+  }
+  index.ec2genes.clear();
+  create_ec2genes(index.ecs, index.genemap, index.ec2genes);
+  return true;
+}
+
+// the contents of a text file, mapped if it is a regular file and read otherwise
+class TextFile {
+ public:
+  TextFile(const std::string &filename) : mapped(nullptr), size(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+        madvise(m, st.st_size, MADV_SEQUENTIAL);
+        mapped = m;
+        size = st.st_size;
+      }
+    }
+    if (mapped == nullptr) {
+      char b[1<<16];
+      ssize_t n;
+      while ((n = read(fd, b, sizeof(b))) > 0) {
+        buf.insert(buf.end(), b, b + n);
+      }
+      size = buf.size();
+    }
+    close(fd);
+  }
+  ~TextFile() {
+    if (mapped != nullptr) {
+      munmap(mapped, size);
+    }
+  }
+  const char *begin() const { return mapped != nullptr ? (const char*) mapped : buf.data(); }
+  const char *end() const { return begin() + size; }
+
+ private:
+  void *mapped;
+  size_t size;
+  std::vector<char> buf;
+};
+
+static inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static inline const char *lineEnd(const char *p, const char *end) {
+  const char *e = (const char*) std::memchr(p, '\n', end - p);
+  return e != nullptr ? e : end;
+}
+
+static size_t countLines(const char *p, const char *end) {
+  size_t n = 0;
+  while (p < end) {
+    p = lineEnd(p, end) + 1;
+    n++;
+  }
+  return n;
+}
+
+// reads the next whitespace separated token of [p, end) into [t, p), returns false if there is none
+static inline bool nextToken(const char *&p, const char *end, const char *&t) {
+  while (p < end && isSpace(*p)) {
+    p++;
+  }
+  t = p;
+  while (p < end && !isSpace(*p)) {
+    p++;
+  }
+  return t < p;
+}
+
+// parses an integer after optional blanks, returns false if there is none
+static inline bool parseInt(const char *&p, const char *end, int32_t &x) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  bool neg = p < end && *p == '-';
+  if (neg || (p < end && *p == '+')) {
+    p++;
+  }
+  if (p == end || *p < '0' || *p > '9') {
+    return false;
+  }
+  int64_t r = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    r = r*10 + (*p++ - '0');
+  }
+  x = (int32_t) (neg ? -r : r);
+  return true;
+}
+
+static void reportECOrder(int32_t ec) {
+  std::cerr << "Error: equivalence class " << ec << " is out of order, classes must be numbered consecutively from 0" << std::endl;
+  exit(1);
+}
+
+// parses the EC lines in [p, end) and appends them to ecs, returns the number of the first one
+// or -1 if there are none. The lines must be numbered consecutively from there
+static int32_t parseECLines(const char *p, const char *end, SetTable &ecs) {
+  int32_t first = -1;
+  size_t base = ecs.size();
   std::vector<int32_t> c;
-  
-  int i = 0;
-  while (std::getline(inf, line)) {       
-    c.clear();
-    int ec = -1;
-    if (line.size() == 0) {
-      continue;
+  while (p < end) {
+    const char *e = lineEnd(p, end);
+    int32_t ec = -1, t;
+    if (parseInt(p, e, ec)) {
+      if (first == -1) {
+        first = ec;
+      }
+      if (ec < 0 || ec != first + (int32_t) (ecs.size() - base)) {
+        reportECOrder(ec);
+      }
+      c.clear();
+      while (parseInt(p, e, t)) {
+        c.push_back(t);
+        if (p < e && *p == ',') {
+          p++;
+        }
+      }
+      ecs.push_back(c);
     }
-    std::stringstream ss(line);
-    ss >> ec;
-    assert(ec == i);
-    while (std::getline(ss, t, ',')) {
-      c.push_back(std::stoi(t));
+    p = e + 1;
+  }
+  return first;
+}
+
+// files larger than this are parsed by several threads, each taking at least this many bytes
+const size_t PARSE_CHUNK = 16ULL << 20;
+
+bool parseECs(const std::string &filename, BUSHeader &header) {
+  if (isECIndex(filename)) {
+    ECIndex index;
+    if (!parseECIndex(filename, index)) {
+      return false;
     }
+    header.ecs = std::move(index.ecs);
+    return true;
+  }
+  auto &ecs = header.ecs; 
+  TextFile f(filename);
+  const char *p = f.begin(), *end = f.end();
+  size_t size = end - p;
+  size_t nt = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), (size + PARSE_CHUNK - 1) / PARSE_CHUNK);
 
-    ecs.push_back(std::move(c));
-    i++;
+  if (nt <= 1) {
+    ecs.reserve(ecs.size() + countLines(p, end), size / 8);
+    int32_t first = parseECLines(p, end, ecs);
+    if (first > 0) {
+      reportECOrder(first);
+    }
+    return true;
   }
 
+  // split at line boundaries
+  std::vector<const char*> split = {p};
+  for (size_t i = 1; i < nt; i++) {
+    const char *q = std::max(split.back(), p + i*size/nt);
+    split.push_back(q < end ? lineEnd(q, end) + 1 : end);
+  }
+  split.push_back(end);
+  std::vector<SetTable> parts(nt);
+  std::vector<int32_t> first(nt);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < nt; i++) {
+    workers.emplace_back([&, i]() {
+      parts[i].reserve(countLines(split[i], split[i+1]), (split[i+1] - split[i]) / 8);
+      first[i] = parseECLines(split[i], split[i+1], parts[i]);
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  // each part has to continue where the ones before it end
+  size_t n = 0;
+  for (size_t i = 0; i < nt; i++) {
+    if (first[i] != -1 && first[i] != (int32_t) n) {
+      reportECOrder(first[i]);
+    }
+    n += parts[i].size();
+  }
+  for (const auto &v : parts) {
+    ecs.append(v);
+  }
   return true;
 }
 
@@ -134,22 +633,23 @@ bool writeECs(const std::string &filename, const BUSHeader &header) {
     return false;
   }
 
-  
+  TextWriter o(&outf);
   size_t n = header.ecs.size();
   for (size_t ec = 0; ec < n; ec++) {
-    const auto& v = header.ecs[ec];
-    outf << ec << "\t";
+    auto v = header.ecs[ec];
+    o.writeUInt(ec).put('\t');
     bool first = true;
     for (auto x : v) {
       if (!first) {
-        outf << ",";
+        o.put(',');
       } else {
         first = false;
       }
-      outf << x;
+      o.writeInt(x);
     }
-    outf << "\n";
+    o.put('\n');
   }
+  o.flush();
   outf.close();
 
   return true;
@@ -177,22 +677,25 @@ bool writeGenes(const std::string &filename, const std::unordered_map<std::strin
 }
 
 bool parseTranscripts(const std::string &filename, std::unordered_map<std::string, int32_t> &txnames) {
-  std::ifstream inf(filename.c_str());
+  TextFile f(filename);
+  const char *p = f.begin(), *end = f.end(), *t;
+  txnames.reserve(txnames.size() + countLines(p, end));
 
   int i = 0;
-  std::string txp;
-  while (inf >> txp) {
-    txnames.insert({txp, i});
+  while (nextToken(p, end, t)) {
+    txnames.insert({std::string(t, p - t), i});
     i++;
   }
   return true;
 }
 
 bool parseTxCaptureList(const std::string &filename, std::unordered_map<std::string, int32_t> &txnames, std::unordered_set<uint64_t> &captures) {
-  std::ifstream inf(filename.c_str());
+  TextFile f(filename);
+  const char *p = f.begin(), *end = f.end(), *t;
 
   std::string txp;
-  while (inf >> txp) {
+  while (nextToken(p, end, t)) {
+    txp.assign(t, p - t);
     auto it = txnames.find(txp);
     if (it == txnames.end()) {
       std::cerr << "Error: could not find capture transcript " << txp << " in transcript list" << std::endl;
@@ -204,28 +707,36 @@ bool parseTxCaptureList(const std::string &filename, std::unordered_map<std::str
 }
 
 bool parseUMIBcCaptureList(const std::string &filename, std::unordered_set<uint64_t> &captures) {
-  std::ifstream inf(filename.c_str());
+  TextFile f(filename);
+  const char *p = f.begin(), *end = f.end();
+  captures.reserve(captures.size() + countLines(p, end));
 
-  std::string inp;
   uint32_t flag; // Unused
-  while (getline(inf, inp)) {
-    captures.insert(stringToBinary(inp, flag));
+  while (p < end) {
+    const char *e = lineEnd(p, end);
+    captures.insert(stringToBinary(p, e - p, flag));
+    p = e + 1;
   }
 
   return true;
 }
 
 bool parseGenes(const std::string &filename, const std::unordered_map<std::string, int32_t> &txnames, std::vector<int32_t> &genemap, std::unordered_map<std::string, int32_t> &genenames) {
-  std::ifstream inf(filename.c_str());
+  TextFile f(filename);
+  const char *p = f.begin(), *end = f.end();
 
-  std::string line, t;
-  line.reserve(10000);
-
-  int i = 0;
-  while (std::getline(inf,line)) {
-    std::stringstream ss(line);
-    std::string txp, gene;
-    ss >> txp >> gene;
+  std::string txp, gene;
+  while (p < end) {
+    const char *e = lineEnd(p, end), *t;
+    txp.clear();
+    gene.clear();
+    if (nextToken(p, e, t)) {
+      txp.assign(t, p - t);
+      if (nextToken(p, e, t)) {
+        gene.assign(t, p - t);
+      }
+    }
+    p = e + 1;
     auto it = txnames.find(txp);
     if (it != txnames.end()) {
       auto i = it->second;
@@ -244,14 +755,494 @@ bool parseGenes(const std::string &filename, const std::unordered_map<std::strin
   return true;
 }
 
-bool writeHeader(std::ostream &outf, const BUSHeader &header) {
+bool writeHeader(std::ostream &outf, const BUSHeader &header, bool tables) {
   outf.write("BUS\0", 4);
   outf.write((char*)(&header.version), sizeof(header.version));
   outf.write((char*)(&header.bclen), sizeof(header.bclen));
   outf.write((char*)(&header.umilen), sizeof(header.umilen));
-  uint32_t tlen = header.text.size();
+  // older readers skip the tables since they are part of the text
+  std::string t = header.text;
+  if (tables) {
+    t.push_back('\0');
+    writeHeaderTables(t, header);
+  }
+  uint32_t tlen = t.size();
   outf.write((char*)(&tlen), sizeof(tlen));
-  outf.write((char*)header.text.c_str(), tlen);
+  outf.write(t.data(), tlen);
+
+  return true;
+}
+
+BUSReader::BUSReader(const std::string &fn, bool stream_in, BUSHeader &h, size_t block_size)
+  : in(nullptr), N(std::max<size_t>(block_size, 1)), mapped(nullptr), mapped_size(0), records(nullptr), data(nullptr), data_end(nullptr), ranged(false), next_range(0), columnar(false), dec_pos(0), cur(0), next_rc(0) {
+  if (!stream_in) {
+    inf.open(fn.c_str(), std::ios::binary);
+    in.rdbuf(inf.rdbuf());
+  } else {
+    in.rdbuf(std::cin.rdbuf());
+  }
+  parseHeader(in, h);
+  if (h.version == BUSFORMAT_VERSION_COLUMNAR) {
+    columnar = true;
+    h.version = BUSFORMAT_VERSION;
+  }
+  if (!stream_in && map(fn, in.tellg())) {
+    inf.close();
+    if (columnar) {
+      data_end = (const char*) mapped + mapped_size;
+    } else {
+      if (((uintptr_t) data) % alignof(BUSData) != 0) {
+        buf[0].resize(N);
+      }
+      return;
+    }
+  }
+  buf[0].resize(N);
+  buf[1].resize(N);
+  fetch();
+}
 
+BUSReader::~BUSReader() {
+  if (reader.joinable()) {
+    reader.join();
+  }
+  if (mapped != nullptr) {
+    munmap(mapped, mapped_size);
+  }
+}
+
+// maps the records of a regular file that start at offset, returns false if the file cannot be mapped
+bool BUSReader::map(const std::string &fn, size_t offset) {
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size <= offset) {
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  mapped = m;
+  mapped_size = st.st_size;
+  records = (const char*) m + offset;
+  data = records;
+  data_end = data + (mapped_size - offset) / sizeof(BUSData) * sizeof(BUSData);
   return true;
 }
+
+// starts reading the next block into the buffer that is not handed out
+void BUSReader::fetch() {
+  BUSData *q = buf[1-cur].data();
+  reader = std::thread([this, q]() {
+    next_rc = fill(q);
+  });
+}
+
+// reads up to N records into q, returns the number read
+size_t BUSReader::fill(BUSData *q) {
+  if (!columnar) {
+    in.read((char*) q, N*sizeof(BUSData));
+    return in.gcount() / sizeof(BUSData);
+  }
+  size_t rc = 0;
+  while (rc < N) {
+    if (dec_pos == dec.size() && !nextBlock()) {
+      break;
+    }
+    size_t c = std::min(N - rc, dec.size() - dec_pos);
+    std::copy(dec.begin() + dec_pos, dec.begin() + dec_pos + c, q + rc);
+    dec_pos += c;
+    rc += c;
+  }
+  return rc;
+}
+
+// decodes the next block of a version 2 file into dec, returns false at the end of the input
+bool BUSReader::nextBlock() {
+  uint32_t hdr[2];
+  const char *b = nullptr;
+  if (mapped != nullptr) {
+    if (data_end - data < (ptrdiff_t) sizeof(hdr)) {
+      return false;
+    }
+    std::memcpy(hdr, data, sizeof(hdr));
+    data += sizeof(hdr);
+    if (data_end - data < (ptrdiff_t) hdr[1]) {
+      return false;
+    }
+    b = data;
+    data += hdr[1];
+  } else {
+    if (!in.read((char*) hdr, sizeof(hdr))) {
+      return false;
+    }
+    enc.resize(hdr[1]);
+    if (!in.read(enc.data(), hdr[1])) {
+      return false;
+    }
+    b = enc.data();
+  }
+  dec.resize(hdr[0]);
+  decodeBUSBlock(b, hdr[0], dec.data());
+  dec_pos = 0;
+  return true;
+}
+
+size_t BUSReader::read(const BUSData *&p) {
+  if (mapped != nullptr && !columnar) {
+    const char *end = data_end;
+    if (ranged) {
+      // skip to the next range that has records left
+      uint64_t i = (data - records) / sizeof(BUSData);
+      while (next_range < ranges.size() && ranges[next_range].second <= i) {
+        next_range++;
+      }
+      if (next_range == ranges.size()) {
+        return 0;
+      }
+      const auto &r = ranges[next_range];
+      data = records + std::max(i, r.first)*sizeof(BUSData);
+      end = std::min(end, records + r.second*sizeof(BUSData));
+      if (data >= end) {
+        return 0;
+      }
+    }
+    size_t rc = std::min<size_t>(N, (end - data) / sizeof(BUSData));
+    if (((uintptr_t) data) % alignof(BUSData) == 0) {
+      p = (const BUSData*) data;
+    } else {
+      // the header leaves the records unaligned, they are copied out of the mapping
+      std::memcpy(buf[0].data(), data, rc*sizeof(BUSData));
+      p = buf[0].data();
+    }
+    data += rc*sizeof(BUSData);
+    return rc;
+  }
+  if (!reader.joinable()) {
+    return 0;
+  }
+  reader.join();
+  size_t rc = next_rc;
+  cur = 1-cur;
+  p = buf[cur].data();
+  if (rc > 0) {
+    fetch();
+  }
+  return rc;
+}
+
+BUSWriter::~BUSWriter() {
+  close();
+}
+
+void BUSWriter::write(const BUSData *p, size_t n) {
+  for (size_t i = 0; i < n; ) {
+    size_t c = std::min(n - i, BUSFORMAT_BLOCK - pending.size());
+    pending.insert(pending.end(), p + i, p + i + c);
+    i += c;
+    if (pending.size() == BUSFORMAT_BLOCK) {
+      flush();
+    }
+  }
+}
+
+void BUSWriter::close() {
+  if (!pending.empty()) {
+    flush();
+  }
+}
+
+void BUSWriter::flush() {
+  enc.clear();
+  encodeBUSBlock(pending.data(), pending.size(), enc);
+  uint32_t hdr[2] = {(uint32_t) pending.size(), (uint32_t) enc.size()};
+  out.write((const char*) hdr, sizeof(hdr));
+  out.write(enc.data(), enc.size());
+  pending.clear();
+}
+
+TextWriter::TextWriter(std::ostream *out, size_t block_size) : out(out), buf(block_size), n(0) {}
+
+TextWriter::~TextWriter() {
+  flush();
+}
+
+void TextWriter::flush() {
+  if (out != nullptr && n > 0) {
+    out->write(buf.data(), n);
+    n = 0;
+  }
+}
+
+void TextWriter::grow(size_t len) {
+  flush();
+  if (n + len > buf.size()) {
+    buf.resize(std::max(2*buf.size(), n + len));
+  }
+}
+
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+TextWriter &TextWriter::writeUInt(uint64_t x) {
+  char t[20];
+  char *e = t + sizeof(t), *q = e;
+  while (x >= 100) {
+    size_t d = 2*(x % 100);
+    x /= 100;
+    q -= 2;
+    q[0] = digit_pairs[d];
+    q[1] = digit_pairs[d+1];
+  }
+  if (x >= 10) {
+    q -= 2;
+    q[0] = digit_pairs[2*x];
+    q[1] = digit_pairs[2*x+1];
+  } else {
+    *--q = '0' + x;
+  }
+  return write(q, e - q);
+}
+
+TextWriter &TextWriter::writeInt(int64_t x) {
+  if (x < 0) {
+    put('-');
+    return writeUInt(-(uint64_t) x);
+  }
+  return writeUInt(x);
+}
+
+TextWriter &TextWriter::writeDouble(double x) {
+  // whole numbers below 10^6 print as integers, everything else goes through %g
+  if (x > -1e6 && x < 1e6 && x == (int64_t) x) {
+    return writeInt((int64_t) x);
+  }
+  char t[32];
+  int len = snprintf(t, sizeof(t), "%g", x);
+  return write(t, len);
+}
+
+TextWriter &TextWriter::writeSequence(uint64_t x, size_t len) {
+  binaryToString(x, len, room(len));
+  n += len;
+  return *this;
+}
+
+// writes the values of v with the number of bits of the largest one, preceded by that number
+static void packColumn(std::vector<char> &b, const std::vector<uint64_t> &v) {
+  uint64_t m = 0;
+  for (auto x : v) {
+    m |= x;
+  }
+  int w = (m == 0) ? 0 : 64 - __builtin_clzll(m);
+  b.push_back((char) w);
+  uint64_t acc = 0;
+  int nb = 0;
+  for (auto x : v) {
+    for (int s = 0; s < w; ) {
+      int take = std::min(w - s, 56);
+      acc |= ((x >> s) & ((1ULL << take) - 1)) << nb;
+      nb += take;
+      s += take;
+      while (nb >= 8) {
+        b.push_back((char) (acc & 0xFF));
+        acc >>= 8;
+        nb -= 8;
+      }
+    }
+  }
+  if (nb > 0) {
+    b.push_back((char) acc);
+  }
+}
+
+static void unpackColumn(const char *&b, std::vector<uint64_t> &v) {
+  int w = (uint8_t) *b++;
+  uint64_t acc = 0;
+  int nb = 0;
+  for (auto &x : v) {
+    x = 0;
+    for (int s = 0; s < w; ) {
+      int take = std::min(w - s, 56);
+      while (nb < take) {
+        acc |= ((uint64_t) (uint8_t) *b++) << nb;
+        nb += 8;
+      }
+      x |= (acc & ((1ULL << take) - 1)) << s;
+      acc >>= take;
+      nb -= take;
+      s += take;
+    }
+  }
+}
+
+// barcodes are stored as runs of equal barcodes, UMIs as differences within a barcode
+void encodeBUSBlock(const BUSData *p, size_t n, std::vector<char> &b) {
+  size_t runs = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 || p[i].barcode != p[i-1].barcode) {
+      runs++;
+    }
+  }
+  putVarint(b, runs);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n; ) {
+    size_t j = i+1;
+    while (j < n && p[j].barcode == p[i].barcode) {
+      j++;
+    }
+    putVarint(b, zigzag((int64_t) (p[i].barcode - prev)));
+    putVarint(b, j - i);
+    prev = p[i].barcode;
+    i = j;
+  }
+
+  std::vector<uint64_t> col(n);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t u = (i > 0 && p[i].barcode == p[i-1].barcode) ? p[i-1].UMI : 0;
+    col[i] = zigzag((int64_t) (p[i].UMI - u));
+  }
+  packColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    col[i] = zigzag(p[i].ec);
+  }
+  packColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    col[i] = p[i].count;
+  }
+  packColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    col[i] = p[i].flags;
+  }
+  packColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    col[i] = p[i].pad;
+  }
+  packColumn(b, col);
+}
+
+void decodeBUSBlock(const char *b, size_t n, BUSData *p) {
+  size_t runs = getVarint(b);
+  uint64_t prev = 0;
+  size_t i = 0;
+  for (size_t r = 0; r < runs; r++) {
+    prev += (uint64_t) unzigzag(getVarint(b));
+    size_t len = getVarint(b);
+    for (size_t j = 0; j < len && i < n; j++) {
+      p[i++].barcode = prev;
+    }
+  }
+
+  std::vector<uint64_t> col(n);
+  unpackColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t u = (i > 0 && p[i].barcode == p[i-1].barcode) ? p[i-1].UMI : 0;
+    p[i].UMI = u + (uint64_t) unzigzag(col[i]);
+  }
+  unpackColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    p[i].ec = (int32_t) unzigzag(col[i]);
+  }
+  unpackColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    p[i].count = (uint32_t) col[i];
+  }
+  unpackColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    p[i].flags = (uint32_t) col[i];
+  }
+  unpackColumn(b, col);
+  for (size_t i = 0; i < n; i++) {
+    p[i].pad = (uint32_t) col[i];
+  }
+}
+
+void BUSReader::setRanges(const std::vector<std::pair<uint64_t, uint64_t>> &r) {
+  ranged = true;
+  ranges = r;
+  next_range = 0;
+}
+
+bool writeIndex(const std::string &filename, const BUSIndex &index) {
+  std::ofstream outf(filename + ".idx", std::ios::binary);
+  outf.write("BUSI", 4);
+  outf.write((char*)(&BUSINDEX_VERSION), sizeof(BUSINDEX_VERSION));
+  outf.write((char*)(&index.block_size), sizeof(index.block_size));
+  outf.write((char*)(&index.offset), sizeof(index.offset));
+  outf.write((char*)(&index.n), sizeof(index.n));
+  uint64_t nb = index.barcodes.size();
+  outf.write((char*)(&nb), sizeof(nb));
+  outf.write((char*)index.barcodes.data(), nb*sizeof(uint64_t));
+  return outf.good();
+}
+
+// reads the index of the BUS file filename, fails if there is none or it does not match the file
+bool parseIndex(const std::string &filename, BUSIndex &index) {
+  std::ifstream inf(filename + ".idx", std::ios::binary);
+  if (!inf.good()) {
+    return false;
+  }
+  char magic[4];
+  uint32_t version = 0;
+  uint64_t nb = 0;
+  inf.read(magic, 4);
+  inf.read((char*)(&version), sizeof(version));
+  if (!inf.good() || std::strncmp(magic, "BUSI", 4) != 0 || version != BUSINDEX_VERSION) {
+    return false;
+  }
+  inf.read((char*)(&index.block_size), sizeof(index.block_size));
+  inf.read((char*)(&index.offset), sizeof(index.offset));
+  inf.read((char*)(&index.n), sizeof(index.n));
+  inf.read((char*)(&nb), sizeof(nb));
+  if (!inf.good() || index.block_size == 0 || nb != (index.n + index.block_size - 1) / index.block_size) {
+    return false;
+  }
+  index.barcodes.resize(nb);
+  inf.read((char*)index.barcodes.data(), nb*sizeof(uint64_t));
+  if (!inf.good()) {
+    return false;
+  }
+
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 || (uint64_t) st.st_size != index.offset + index.n*sizeof(BUSData)) {
+    std::cerr << "Warning: index " << filename << ".idx does not match the BUS file, ignoring it" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// returns the sorted and disjoint ranges of records that hold all records with the given barcodes
+std::vector<std::pair<uint64_t, uint64_t>> indexRanges(const BUSIndex &index, std::vector<uint64_t> barcodes) {
+  std::vector<std::pair<uint64_t, uint64_t>> r;
+  std::sort(barcodes.begin(), barcodes.end());
+  const auto &b = index.barcodes;
+  for (auto bc : barcodes) {
+    // the records of bc can start in the last block starting before bc
+    uint64_t lo = std::lower_bound(b.begin(), b.end(), bc) - b.begin();
+    uint64_t hi = std::upper_bound(b.begin(), b.end(), bc) - b.begin();
+    if (lo > 0) {
+      lo--;
+    }
+    if (lo == hi) {
+      continue;
+    }
+    lo *= index.block_size;
+    hi = std::min(hi*index.block_size, index.n);
+    if (!r.empty() && lo <= r.back().second) {
+      r.back().second = std::max(r.back().second, hi);
+    } else {
+      r.push_back({lo, hi});
+    }
+  }
+  return r;
+}
@@ -7,8 +7,25 @@
 #include <unordered_set>
 #include <stdint.h>
 #include <fstream>
+#include <thread>
+
+#include "Common.hpp"
 
 const uint32_t BUSFORMAT_VERSION = 1;
+// version 2 files store the records in compressed blocks of up to BUSFORMAT_BLOCK records, each
+// a uint32_t record count and byte size followed by the barcode runs and the bit packed UMI, ec,
+// count, flags and pad columns
+const uint32_t BUSFORMAT_VERSION_COLUMNAR = 2;
+const size_t BUSFORMAT_BLOCK = 1ULL << 16;
+const uint32_t BUSINDEX_VERSION = 1;
+// the matrix of count --binary, little-endian: the magic "BUSM", uint32_t version, value type
+// (0 for uint32_t, 1 for float) and barcode length. Then blocks of rows, each the uint32_t number
+// of rows and of entries, the uint64_t barcodes of the rows, the uint32_t number of entries in each
+// row, the uint32_t columns (from 0) of the entries and their values. A block of no rows ends the
+// matrix and is followed by the uint64_t number of rows, columns and entries, and the uint32_t
+// number of column names, each a uint32_t length and the name
+const uint32_t BUSMATRIX_VERSION = 1;
+const uint32_t ECINDEX_VERSION = 1;
 
 struct BUSTranscript {
   std::string name;
@@ -21,7 +38,7 @@ struct BUSTranscript {
 struct BUSHeader {
   std::string text;
   std::vector<BUSTranscript> transcripts;
-  std::vector<std::vector<int32_t>> ecs;
+  SetTable ecs;
   uint32_t version;
   uint32_t bclen;
   uint32_t umilen;
@@ -38,11 +55,188 @@ struct BUSData {
   BUSData() : barcode(0), UMI(0), ec(-1), count(0), flags(0), pad(0) {}
 };
 
+// block index of a sorted BUS file, stored next to it as <file>.idx. Block i holds the records
+// [i*block_size, (i+1)*block_size) and its first barcode is barcodes[i]
+struct BUSIndex {
+  uint64_t block_size;
+  uint64_t offset; // byte offset of the first record
+  uint64_t n; // number of records
+  std::vector<uint64_t> barcodes;
+  BUSIndex() : block_size(0), offset(0), n(0) {}
+};
+
+// the ECs, transcript names and transcript to gene map compiled into one binary file by
+// bustools index, together with the genes of each EC
+struct ECIndex {
+  SetTable ecs;
+  std::vector<std::string> transcripts;
+  std::vector<std::string> genes;
+  std::vector<int32_t> genemap; // gene of each transcript, -1 if it has none
+  SetTable ec2genes;
+};
+
+
+inline void putVarint(std::vector<char> &b, uint64_t x) {
+  while (x >= 0x80) {
+    b.push_back((char) (x | 0x80));
+    x >>= 7;
+  }
+  b.push_back((char) x);
+}
+
+inline uint64_t getVarint(const char *&p) {
+  uint64_t x = 0;
+  int sh = 0;
+  while (*p & 0x80) {
+    x |= ((uint64_t) (*p++ & 0x7F)) << sh;
+    sh += 7;
+  }
+  x |= ((uint64_t) *p++) << sh;
+  return x;
+}
+
+// maps small negative and positive numbers to small unsigned ones
+inline uint64_t zigzag(int64_t x) {
+  return (((uint64_t) x) << 1) ^ (uint64_t) (x >> 63);
+}
+
+inline int64_t unzigzag(uint64_t z) {
+  return (int64_t) ((z >> 1) ^ (~(z & 1) + 1));
+}
+
+void encodeBUSBlock(const BUSData *p, size_t n, std::vector<char> &b);
+void decodeBUSBlock(const char *b, size_t n, BUSData *p);
+
+// reads the header and records of the BUS file fn, or of standard input if stream_in is set, in
+// blocks of block_size records. Regular files are memory mapped and blocks point into the mapping
+// when the records are aligned, otherwise the next block is read on a background thread while the
+// current one is processed. Version 2 files are decoded and h describes the decoded records
+class BUSReader {
+ public:
+  BUSReader(const std::string &fn, bool stream_in, BUSHeader &h, size_t block_size = 100000);
+  ~BUSReader();
+  BUSReader(const BUSReader&) = delete;
+  BUSReader& operator=(const BUSReader&) = delete;
+
+  // points p to the next block of records and returns its size, 0 at the end of the input.
+  // The block stays valid until the next call
+  size_t read(const BUSData *&p);
+
+  // limits the records read from an uncompressed memory mapped file to the sorted and disjoint
+  // record ranges, other input is read in full
+  void setRanges(const std::vector<std::pair<uint64_t, uint64_t>> &r);
+
+ private:
+  bool map(const std::string &fn, size_t offset);
+  void fetch();
+  size_t fill(BUSData *q);
+  bool nextBlock();
+
+  std::ifstream inf;
+  std::istream in;
+  size_t N;
+  // memory mapped input, records are in [data, data_end)
+  void *mapped;
+  size_t mapped_size;
+  const char *records;
+  const char *data;
+  const char *data_end;
+  bool ranged;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  size_t next_range;
+  // decoded block of a version 2 file
+  bool columnar;
+  std::vector<char> enc;
+  std::vector<BUSData> dec;
+  size_t dec_pos;
+  // streamed input
+  std::vector<BUSData> buf[2];
+  int cur;
+  size_t next_rc;
+  std::thread reader;
+};
+
+// writes records as the compressed blocks of a version 2 file, close() writes the last block
+class BUSWriter {
+ public:
+  BUSWriter(std::ostream &out) : out(out) {}
+  ~BUSWriter();
+  void write(const BUSData *p, size_t n);
+  void close();
+
+ private:
+  void flush();
+
+  std::ostream &out;
+  std::vector<BUSData> pending;
+  std::vector<char> enc;
+};
+
+// formats text into a buffer that is written to out in blocks of about block_size bytes, or kept
+// in the buffer when there is no out. Numbers and sequences are formatted without iostreams
+class TextWriter {
+ public:
+  TextWriter(std::ostream *out = nullptr, size_t block_size = 1ULL << 20);
+  ~TextWriter();
+  TextWriter(const TextWriter&) = delete;
+  TextWriter& operator=(const TextWriter&) = delete;
+
+  TextWriter &put(char c) {
+    *room(1) = c;
+    n++;
+    return *this;
+  }
+  TextWriter &write(const char *s, size_t len) {
+    std::copy(s, s + len, room(len));
+    n += len;
+    return *this;
+  }
+  TextWriter &write(const std::string &s) {
+    return write(s.data(), s.size());
+  }
+  TextWriter &writeInt(int64_t x);
+  TextWriter &writeUInt(uint64_t x);
+  // as std::ostream writes x with its default precision of 6
+  TextWriter &writeDouble(double x);
+  // the 2 bit encoded sequence x of length len
+  TextWriter &writeSequence(uint64_t x, size_t len);
+
+  const char *data() const { return buf.data(); }
+  size_t size() const { return n; }
+  void clear() { n = 0; }
+  // writes the buffer to out
+  void flush();
+
+ private:
+  // space for len more characters
+  char *room(size_t len) {
+    if (n + len > buf.size()) {
+      grow(len);
+    }
+    return &buf[n];
+  }
+  void grow(size_t len);
+
+  std::ostream *out;
+  std::vector<char> buf;
+  size_t n;
+};
+
 
 bool parseHeader(std::istream &inf, BUSHeader &header);
-bool writeHeader(std::ostream &outf, const BUSHeader &header);
+// the EC and transcript tables of the header are only written if tables is set
+bool writeHeader(std::ostream &outf, const BUSHeader &header, bool tables = false);
+bool writeIndex(const std::string &filename, const BUSIndex &index);
+bool parseIndex(const std::string &filename, BUSIndex &index);
+std::vector<std::pair<uint64_t, uint64_t>> indexRanges(const BUSIndex &index, std::vector<uint64_t> barcodes);
 
 
+bool readHeader(const std::string &filename, BUSHeader &header);
+bool parseECsAndTranscripts(const std::string &ecf, const std::string &txf, const std::string &busf, BUSHeader &header, std::unordered_map<std::string, int32_t> &txnames);
+bool isECIndex(const std::string &filename);
+bool writeECIndex(const std::string &filename, const ECIndex &index);
+bool parseECIndex(const std::string &filename, ECIndex &index);
+bool loadECIndex(const std::string &ecf, const std::string &txf, const std::string &genef, const std::string &busf, ECIndex &index);
 bool parseECs(const std::string &filename, BUSHeader &header);
 bool writeECs(const std::string &filename, const BUSHeader &header);
 bool writeGenes(const std::string &filename, const std::unordered_map<std::string, int32_t>  &genenames);
@@ -54,5 +248,16 @@ bool parseTranscripts(const std::string &filename, std::unordered_map<std::strin
 uint64_t stringToBinary(const std::string &s, uint32_t &flag);
 uint64_t stringToBinary(const char* s, const size_t len, uint32_t &flag);
 std::string binaryToString(uint64_t x, size_t len);
-int hamming(uint64_t a, uint64_t b, size_t len);
+void binaryToString(uint64_t x, size_t len, char *s);
+
+// number of bases that differ between the len bases of a and b: the two bits of each base of a^b
+// are or'ed into the low one and counted
+inline int hamming(uint64_t a, uint64_t b, size_t len) {
+  uint64_t df = a ^ b;
+  df = (df | (df >> 1)) & 0x5555555555555555ULL;
+  if (len < 32) {
+    df &= (1ULL << (2*len)) - 1;
+  }
+  return __builtin_popcountll(df);
+}
 #endif // KALLISTO_BUSDATA_H
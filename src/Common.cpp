@@ -1,23 +1,250 @@
 #include "Common.hpp"
 
+#include <cstring>
 
-std::vector<int32_t> intersect(std::vector<int32_t> &u, std::vector<int32_t> &v) {
-  std::vector<int32_t> res;
-  auto a = u.begin();
-  auto b = v.begin();
-
-  while (a != u.end() && b != v.end()) {
-    if (*a < *b) {
-      ++a;
-    } else if (*b < *a) {
-      ++b;
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define BUSTOOLS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+void ECSetMap::reserve(size_t n) {
+  size_t m = rndup(std::max<size_t>(2*n, 16));
+  if (m <= slots.size()) {
+    return;
+  }
+  slots.assign(m, 0);
+  mask = m - 1;
+  for (size_t k = 0; k < ecs.size(); k++) {
+    size_t i = hashes[k] & mask;
+    while (slots[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = k + 1;
+  }
+}
+
+// returns the slot holding the set p[0..n) with hash h, or the empty slot where it would go
+size_t ECSetMap::probe(const int32_t *p, size_t n, uint64_t h) const {
+  size_t i = h & mask;
+  while (slots[i] != 0) {
+    size_t k = slots[i] - 1;
+    if (hashes[k] == h && sets[k].size() == n && std::memcmp(sets[k].data(), p, n*sizeof(int32_t)) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void ECSetMap::clear() {
+  sets.clear();
+  hashes.clear();
+  ecs.clear();
+  std::fill(slots.begin(), slots.end(), 0);
+}
+
+int32_t ECSetMap::find(const int32_t *p, size_t n) const {
+  if (slots.empty()) {
+    return -1;
+  }
+  size_t i = probe(p, n, hash_ec(p, n));
+  return slots[i] != 0 ? ecs[slots[i] - 1] : -1;
+}
+
+bool ECSetMap::insert(const int32_t *p, size_t n, int32_t ec) {
+  if (2*(ecs.size() + 1) > slots.size()) {
+    reserve(ecs.size() + 1);
+  }
+  uint64_t h = hash_ec(p, n);
+  size_t i = probe(p, n, h);
+  if (slots[i] != 0) {
+    return false;
+  }
+  sets.push_back(p, p + n);
+  hashes.push_back(h);
+  ecs.push_back(ec);
+  slots[i] = ecs.size();
+  return true;
+}
+
+
+namespace {
+
+typedef size_t (*intersect_fn)(const int32_t *, size_t, const int32_t *, size_t, int32_t *);
+
+// sets that differ in size by more than this factor are intersected by searching the larger one
+const size_t GALLOP_RATIO = 32;
+
+size_t intersect_scalar(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
     } else {
-      // match
-      res.push_back(*a);
-      ++a;
-      ++b;
+      out[k++] = a[i]; // k <= i, so out can be a
+      i++;
+      j++;
     }
   }
+  return k;
+}
+
+// looks up every element of the small set s in l with an exponential search
+size_t intersect_gallop(const int32_t *s, size_t ns, const int32_t *l, size_t nl, int32_t *out) {
+  size_t k = 0, lo = 0;
+  for (size_t i = 0; i < ns && lo < nl; i++) {
+    int32_t x = s[i];
+    size_t hi = lo, step = 1;
+    while (hi < nl && l[hi] < x) {
+      lo = hi + 1;
+      hi += step;
+      step <<= 1;
+    }
+    lo = std::lower_bound(l + lo, l + std::min(hi, nl), x) - l;
+    if (lo < nl && l[lo] == x) {
+      out[k++] = x;
+      lo++;
+    }
+  }
+  return k;
+}
+
+#ifdef BUSTOOLS_X86_SIMD
+// writes the lanes of t selected by mask to out
+inline size_t emit_lanes(const int32_t *t, unsigned mask, int32_t *out) {
+  size_t n = 0;
+  while (mask != 0) {
+    out[n++] = t[__builtin_ctz(mask)];
+    mask &= mask - 1;
+  }
+  return n;
+}
+
+// Blocks of W elements from a and b are compared all against all, matches are written out right
+// away and the block with the smaller last element is replaced. The a block is kept in ta so out
+// can overwrite a. When b runs out first, the part of the a block up to the last b block is done
+// and the rest is left to the scalar loop.
+#define INTERSECT_BLOCKS(W, LOAD, STORE, MATCH)                             \
+  size_t i = 0, j = 0, k = 0;                                               \
+  if (na >= W && nb >= W) {                                                 \
+    int32_t ta[W];                                                          \
+    auto va = LOAD(a);                                                      \
+    auto vb = LOAD(b);                                                      \
+    STORE(ta, va);                                                          \
+    while (true) {                                                          \
+      k += emit_lanes(ta, MATCH(va, vb), out + k);                          \
+      int32_t amax = ta[W-1], bmax = b[j+W-1];                              \
+      if (amax <= bmax) {                                                   \
+        i += W;                                                             \
+      }                                                                     \
+      if (bmax <= amax) {                                                   \
+        j += W;                                                             \
+      }                                                                     \
+      if (i + W > na || j + W > nb) {                                       \
+        if (bmax < amax) {                                                  \
+          size_t c = 0;                                                     \
+          while (ta[c] <= bmax) {                                           \
+            c++;                                                            \
+          }                                                                 \
+          i += c;                                                           \
+        }                                                                   \
+        break;                                                              \
+      }                                                                     \
+      if (amax <= bmax) {                                                   \
+        va = LOAD(a + i);                                                   \
+        STORE(ta, va);                                                      \
+      }                                                                     \
+      if (bmax <= amax) {                                                   \
+        vb = LOAD(b + j);                                                   \
+      }                                                                     \
+    }                                                                       \
+  }                                                                         \
+  return k + intersect_scalar(a + i, na - i, b + j, nb - j, out + k);
+
+inline __m128i load_sse2(const int32_t *p) {
+  return _mm_loadu_si128((const __m128i *) p);
+}
+
+inline void store_sse2(int32_t *p, __m128i v) {
+  _mm_storeu_si128((__m128i *) p, v);
+}
+
+// mask of the lanes of va equal to some lane of vb
+inline unsigned match_sse2(__m128i va, __m128i vb) {
+  __m128i m0 = _mm_cmpeq_epi32(va, vb);
+  __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1)));
+  __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2)));
+  __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3)));
+  __m128i m = _mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3));
+  return _mm_movemask_ps(_mm_castsi128_ps(m));
+}
+
+size_t intersect_sse2(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+  INTERSECT_BLOCKS(4, load_sse2, store_sse2, match_sse2)
+}
+
+__attribute__((target("avx2")))
+inline __m256i load_avx2(const int32_t *p) {
+  return _mm256_loadu_si256((const __m256i *) p);
+}
+
+__attribute__((target("avx2")))
+inline void store_avx2(int32_t *p, __m256i v) {
+  _mm256_storeu_si256((__m256i *) p, v);
+}
+
+__attribute__((target("avx2")))
+inline unsigned match_avx2(__m256i va, __m256i vb) {
+  const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  __m256i m = _mm256_cmpeq_epi32(va, vb);
+  for (int r = 1; r < 8; r++) {
+    vb = _mm256_permutevar8x32_epi32(vb, rot);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+  }
+  return _mm256_movemask_ps(_mm256_castsi256_ps(m));
+}
+
+__attribute__((target("avx2")))
+size_t intersect_avx2(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+  INTERSECT_BLOCKS(8, load_avx2, store_avx2, match_avx2)
+}
+#endif // BUSTOOLS_X86_SIMD
+
+intersect_fn pick_intersect_kernel() {
+#ifdef BUSTOOLS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return intersect_avx2;
+  }
+  return intersect_sse2;
+#else
+  return intersect_scalar;
+#endif
+}
+
+} // namespace
+
+size_t intersect_sorted(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+  static const intersect_fn kernel = pick_intersect_kernel();
+
+  if (na == 0 || nb == 0 || a[na-1] < b[0] || b[nb-1] < a[0]) {
+    return 0;
+  }
+  if (na > GALLOP_RATIO * nb) {
+    return intersect_gallop(b, nb, a, na, out);
+  }
+  if (nb > GALLOP_RATIO * na) {
+    return intersect_gallop(a, na, b, nb, out);
+  }
+  return kernel(a, na, b, nb, out);
+}
+
+std::vector<int32_t> intersect(std::vector<int32_t> &u, std::vector<int32_t> &v) {
+  std::vector<int32_t> res(std::min(u.size(), v.size()));
+  res.resize(intersect_sorted(u.data(), u.size(), v.data(), v.size(), res.data()));
   return std::move(res);
 }
 
@@ -38,111 +265,54 @@ std::vector<int32_t> intersect_vectors(const std::vector<std::vector<int32_t>> &
   std::vector<int32_t> u;
 
   if (!v.empty()) {
-    u = v[0]; // copy
+    // start from the smallest set, it bounds the size of the intersection
+    size_t first = 0;
     for (size_t i = 1; i < v.size(); i++) {
-      auto &vv = v[i];
-      int j = 0;
-      int k = 0;
-      int l = 0;
-      int n = u.size();
-      int m = vv.size();
-      // u and v are sorted, j,k,l = 0
-      while (j < n && l < m) {
-        // invariant: u[:k] is the intersection of u[:j] and vv[:l], j <= n, l <= m
-        //            u[:j] <= u[j:], vv[:l] <= v[l:], u[j:] is sorted, v[l:] is sorted, u[:k] is sorted
-        if (u[j] < vv[l]) {
-          j++;
-        } else if (u[j] > vv[l]) {
-          l++;
-        } else {
-          // match
-          if (k < j) {
-            std::swap(u[k], u[j]);
-          }
-          k++;
-          j++;
-          l++;
-        }
+      if (v[i].size() < v[first].size()) {
+        first = i;
+      }
+    }
+    u = v[first]; // copy
+    for (size_t i = 0; i < v.size() && !u.empty(); i++) {
+      if (i != first) {
+        u.resize(intersect_sorted(u.data(), u.size(), v[i].data(), v[i].size(), u.data()));
       }
-      if (k < n) {
-        u.resize(k);
-      }    
     }
   }
 
   return std::move(u);
 }
 
-int32_t intersect_ecs(const std::vector<int32_t> &ecs, std::vector<int32_t> &u, std::vector<std::vector<int32_t>> &ecmap, std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> &ecmapinv) {
-  if (ecs.empty()) {
-    return -1;
-  }
-
-  if (ecs[0] < 0 || ecs[0] >= ecmap.size()) {
-    return -1;
-  }
-  
-  if (ecs.size() == 1) {
-    return ecs[0]; // no work
-  }
-
+bool intersect_ecs(const std::vector<int32_t> &ecs, std::vector<int32_t> &u, const SetTable &ecmap) {
   u.resize(0);
-  auto &v = ecmap[ecs[0]]; // copy
-  for (size_t i = 0; i< v.size(); i++) {
-    u.push_back(v[i]);
+  if (ecs.empty()) {
+    return false;
   }
 
-  for (size_t i = 1; i < ecs.size(); i++) {
-    if (ecs[i] < 0 || ecs[i] >= ecmap.size()) {
-      return -1;
+  size_t first = 0;
+  for (size_t i = 0; i < ecs.size(); i++) {
+    if (ecs[i] < 0 || ecs[i] >= (int32_t) ecmap.size()) {
+      return false;
     }
-    const auto &v = ecmap[ecs[i]];
-
-    int j = 0;
-    int k = 0;
-    int l = 0;
-    int n = u.size();
-    int m = v.size();
-    // u and v are sorted, j,k,l = 0
-    while (j < n && l < m) {
-      // invariant: u[:k] is the intersection of u[:j] and v[:l], j <= n, l <= m
-      //            u[:j] <= u[j:], v[:l] <= v[l:], u[j:] is sorted, v[l:] is sorted, u[:k] is sorted
-      if (u[j] < v[l]) {
-        j++;
-      } else if (u[j] > v[l]) {
-        l++;
-      } else {
-        // match
-        if (k < j) {
-          std::swap(u[k], u[j]);
-        }
-        k++;
-        j++;
-        l++;
-      }
-    }
-    if (k < n) {
-      u.resize(k);
+    if (ecmap[ecs[i]].size() < ecmap[ecs[first]].size()) {
+      first = i;
     }
   }
 
-  if (u.empty()) {
-    return -1;
-  }
-  auto iit = ecmapinv.find(u);
-  if (iit == ecmapinv.end()) { 
-    // create new equivalence class
-    int32_t ec = ecmap.size();
-    ecmap.push_back(u);
-    ecmapinv.insert({u,ec});
-    return ec;
-  } else {
-    return iit->second;
+  // start from the smallest class, it bounds the size of the intersection
+  auto v = ecmap[ecs[first]]; // copy
+  u.assign(v.begin(), v.end());
+
+  for (size_t i = 0; i < ecs.size() && !u.empty(); i++) {
+    if (i != first) {
+      auto v = ecmap[ecs[i]];
+      u.resize(intersect_sorted(u.data(), u.size(), v.data(), v.size(), u.data()));
+    }
   }
+  return true;
 }
 
-
-void vt2gene(const std::vector<int32_t> &v, const std::vector<int32_t> &genemap, std::vector<int32_t> &glist) {
+void vt2gene(SetTable::Set v, const std::vector<int32_t> &genemap, std::vector<int32_t> &glist) {
   int lastg = -2;
   int n = v.size();
 
@@ -164,56 +334,37 @@ void vt2gene(const std::vector<int32_t> &v, const std::vector<int32_t> &genemap,
 }
 
 
-void intersect_genes_of_ecs(const std::vector<int32_t> &ecs, const  std::vector<std::vector<int32_t>> &ec2genes, std::vector<int32_t> &glist) {
+void intersect_genes_of_ecs(const std::vector<int32_t> &ecs, const SetTable &ec2genes, std::vector<int32_t> &glist) {
   glist.resize(0);
   if  (ecs.empty()) {
     return;
   }
-  // copy first to glist
-  const auto &v = ec2genes[ecs[0]];
-  for (auto x : v) {
-    glist.push_back(x);
+  // copy the smallest gene list to glist
+  size_t first = 0;
+  for (size_t i = 1; i < ecs.size(); i++) {
+    if (ec2genes[ecs[i]].size() < ec2genes[ecs[first]].size()) {
+      first = i;
+    }
   }
+  auto v = ec2genes[ecs[first]];
+  glist.assign(v.begin(), v.end());
   // intersect the rest
-  for (int i = 1; i < ecs.size(); i++) {
-    const auto &v = ec2genes[ecs[i]];
-
-    int j = 0;
-    int k = 0;
-    int l = 0;
-    int n = glist.size();
-    int m = v.size();
-    // u and v are sorted, j,k,l = 0
-    while (j < n && l < m) {
-      // invariant: u[:k] is the intersection of u[:j] and v[:l], j <= n, l <= m
-      //            u[:j] <= u[j:], v[:l] <= v[l:], u[j:] is sorted, v[l:] is sorted, u[:k] is sorted
-      if (glist[j] < v[l]) {
-        j++;
-      } else if (glist[j] > v[l]) {
-        l++;
-      } else {
-        // match
-        if (k < j) {
-          std::swap(glist[k], glist[j]);
-        }
-        k++;
-        j++;
-        l++;
-      }
-    }
-    if (k < n) {
-      glist.resize(k);
+  for (size_t i = 0; i < ecs.size() && !glist.empty(); i++) {
+    if (i != first) {
+      auto v = ec2genes[ecs[i]];
+      glist.resize(intersect_sorted(glist.data(), glist.size(), v.data(), v.size(), glist.data()));
     }
   }
 }
 
 
-int32_t intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vector<int32_t> &genemap, std::vector<std::vector<int32_t>> &ecmap, std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> &ecmapinv, std::vector<std::vector<int32_t>> &ec2genes, bool assumeIntersectionIsEmpty) {
+void intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vector<int32_t> &genemap, const SetTable &ecmap, const SetTable &ec2genes, std::vector<int32_t> &u, bool assumeIntersectionIsEmpty) {
   
   std::vector<std::vector<int32_t>> gu; // per gene transcript results
-  std::vector<int32_t> u; // final list of transcripts
   std::vector<int32_t> glist;
 
+  u.resize(0);
+
   int32_t lastg = -2;
   // todo, replace by intersection of the genelist
   for (const auto ec : ecs) {
@@ -223,14 +374,14 @@ int32_t intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vec
       lastg = g[0];
     } else if (g.size() > 1) {
       lastg = -2;
-      for (auto &x : g) {
+      for (auto x : g) {
         glist.push_back(x);
       }
     }
   }
   
   if (glist.empty()) {
-    return -1;
+    return;
   }
 
   // sort and remove unique
@@ -246,20 +397,6 @@ int32_t intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vec
     }
     std::sort(u.begin(), u.end());
     u.erase(std::unique(u.begin(), u.end()), u.end());
-
-    // look up ecs based on u
-    int32_t ec = -1;
-    
-    auto it = ecmapinv.find(u);
-    if (it != ecmapinv.end()) {
-      ec = it->second;              
-    } else {
-      ec = ecmapinv.size();
-      ecmapinv.insert({u,ec});
-      // todo: update ec2genes?
-    }
-
-    return ec; // done
   } else {
     // separate per gene
     for (auto g : glist) {
@@ -288,30 +425,17 @@ int32_t intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vec
       }
     }
 
-    if (u.empty()) {
-      return -1;
-    }
     std::sort(u.begin(), u.end());
-
-    int32_t ec = -1;
-    auto it = ecmapinv.find(u);
-    if (it != ecmapinv.end()) {
-      ec = it->second;              
-    } else {
-      ec = ecmapinv.size();
-      ecmapinv.insert({u,ec});
-    }
-    return ec;
   } 
   
 }
 
-
-void create_ec2genes(const std::vector<std::vector<int32_t>> &ecmap, const std::vector<int32_t> &genemap, std::vector<std::vector<int32_t>> &ec2gene) {
+void create_ec2genes(const SetTable &ecmap, const std::vector<int32_t> &genemap, SetTable &ec2gene) {
   std::vector<int32_t> u;
+  ec2gene.reserve(ec2gene.size() + ecmap.size(), ecmap.size());
   for (int ec = 0; ec < ecmap.size(); ec++) {
-    const auto &v = ecmap[ec];    
-    vt2gene(v, genemap, u);
-    ec2gene.push_back(std::move(u));
+    vt2gene(ecmap[ec], genemap, u);
+    ec2gene.push_back(u);
+    u.clear();
   }
 }
\ No newline at end of file
@@ -28,12 +28,20 @@ struct Bustools_opt {
   int ec_dmin;
   size_t max_memory;
   std::string temp_files;
+  int max_fanin;
+  bool compress_temp = false;
+  bool sort_index = false;
+  bool sort_columnar = false;
 
   std::string count_genes;
   std::string count_ecs;
   std::string count_txp;
   bool count_collapse = false;
   bool count_gene_multimapping = false;
+  bool count_binary = false;
+  bool count_unsorted = false;
+  bool count_tcc_and_genes = false;
+  bool count_umi_correct = false;
 
   std::string capture;
   char type;
@@ -47,7 +55,7 @@ struct Bustools_opt {
 
   int start, end;
 
-  Bustools_opt() : threads(1), max_memory(1ULL<<32), type(TYPE_NONE),
+  Bustools_opt() : threads(1), max_memory(1ULL<<32), max_fanin(128), type(TYPE_NONE),
     threshold(0), start(-1), end(-1)  {}
 };
 
@@ -81,27 +89,134 @@ inline uint32_t rndup(uint32_t v) {
 }
 
 
+// 64 bit hash of a set of transcripts
+inline uint64_t hash_ec(const int32_t *p, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (uint32_t) p[i]) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
 struct SortedVectorHasher {
   size_t operator()(const std::vector<int32_t>& v) const {
-    uint64_t r = 0;
-    int i=0;
-    for (auto x : v) {
-      uint64_t t = std::hash<int32_t>{}(x);
-      t = (x>>i) | (x<<(64-i));
-      r = r ^ t;
-      i = (i+1)%64;
+    return hash_ec(v.data(), v.size());
+  }
+};
+
+// sets of transcripts or genes stored back to back in one array (compressed sparse rows), set i
+// is values[offsets[i]..offsets[i+1]). Sets handed out are invalidated by push_back
+class SetTable {
+ public:
+  class Set {
+   public:
+    Set(const int32_t *b, const int32_t *e) : b(b), e(e) {}
+    const int32_t *begin() const { return b; }
+    const int32_t *end() const { return e; }
+    const int32_t *data() const { return b; }
+    size_t size() const { return e - b; }
+    bool empty() const { return b == e; }
+    int32_t operator[](size_t i) const { return b[i]; }
+
+   private:
+    const int32_t *b, *e;
+  };
+
+  class const_iterator {
+   public:
+    const_iterator(const SetTable &t, size_t i) : t(t), i(i) {}
+    Set operator*() const { return t[i]; }
+    const_iterator &operator++() { i++; return *this; }
+    bool operator!=(const const_iterator &o) const { return i != o.i; }
+
+   private:
+    const SetTable &t;
+    size_t i;
+  };
+
+  SetTable() : offsets(1, 0) {}
+  size_t size() const { return offsets.size() - 1; }
+  bool empty() const { return offsets.size() == 1; }
+  Set operator[](size_t i) const { return Set(values.data() + offsets[i], values.data() + offsets[i+1]); }
+  const_iterator begin() const { return const_iterator(*this, 0); }
+  const_iterator end() const { return const_iterator(*this, size()); }
+
+  void reserve(size_t n, size_t nvalues) {
+    offsets.reserve(n + 1);
+    values.reserve(nvalues);
+  }
+  // appends the set [b, e), which must not be part of this table
+  template <typename It>
+  void push_back(It b, It e) {
+    values.insert(values.end(), b, e);
+    offsets.push_back(values.size());
+  }
+  template <typename S>
+  void push_back(const S &s) {
+    push_back(s.begin(), s.end());
+  }
+  void append(const SetTable &t) {
+    size_t base = values.size();
+    values.insert(values.end(), t.values.begin(), t.values.end());
+    for (size_t i = 1; i < t.offsets.size(); i++) {
+      offsets.push_back(base + t.offsets[i]);
     }
-    return r;
   }
+  void clear() {
+    values.clear();
+    offsets.assign(1, 0);
+  }
+
+ private:
+  std::vector<int32_t> values;
+  std::vector<size_t> offsets;
 };
+
+// maps sorted sets of transcripts to their EC. The sets are stored in a SetTable and looked up by
+// linear probing in a table of at most half full slots
+class ECSetMap {
+ public:
+  ECSetMap() : mask(0) {}
+  void reserve(size_t n);
+  size_t size() const { return ecs.size(); }
+  // returns the EC of the set v, -1 if it is not in the map
+  int32_t find(const int32_t *p, size_t n) const;
+  // adds the set v with EC ec, returns false and leaves the map unchanged if v is already there
+  bool insert(const int32_t *p, size_t n, int32_t ec);
+  template <typename S>
+  int32_t find(const S &v) const { return find(v.data(), v.size()); }
+  template <typename S>
+  bool insert(const S &v, int32_t ec) { return insert(v.data(), v.size(), ec); }
+  void clear();
+
+ private:
+  size_t probe(const int32_t *p, size_t n, uint64_t h) const;
+
+  SetTable sets;
+  std::vector<uint64_t> hashes;
+  std::vector<int32_t> ecs;
+  std::vector<uint32_t> slots; // index of the set + 1, 0 if empty
+  size_t mask;
+};
+
+// intersection of the sorted sets a and b written to out, returns its size. out may be a but
+// must not overlap b otherwise
+size_t intersect_sorted(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out);
+
 std::vector<int32_t> intersect(std::vector<int32_t> &u, std::vector<int32_t> &v);
 std::vector<int32_t> union_vectors(const std::vector<std::vector<int32_t>> &v);
 std::vector<int32_t> intersect_vectors(const std::vector<std::vector<int32_t>> &v);
-int32_t intersect_ecs(const std::vector<int32_t> &ecs, std::vector<int32_t> &u, std::vector<std::vector<int32_t>> &ecmap, std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> &ecmapinv);
-void vt2gene(const std::vector<int32_t> &v, const std::vector<int32_t> &genemap, std::vector<int32_t> &glist);
-void intersect_genes_of_ecs(const std::vector<int32_t> &ecs, const  std::vector<std::vector<int32_t>> &ec2genes, std::vector<int32_t> &glist);
-int32_t intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vector<int32_t> &genemap, std::vector<std::vector<int32_t>> &ecmap, std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> &ecmapinv, std::vector<std::vector<int32_t>> &ec2genes, bool assumeIntersectionIsEmpty = true);
-void create_ec2genes(const std::vector<std::vector<int32_t>> &ecmap, const std::vector<int32_t> &genemap, std::vector<std::vector<int32_t>> &ec2gene);
+// intersection of the classes ecs in u, false if one of them is not in ecmap
+bool intersect_ecs(const std::vector<int32_t> &ecs, std::vector<int32_t> &u, const SetTable &ecmap);
+void vt2gene(SetTable::Set v, const std::vector<int32_t> &genemap, std::vector<int32_t> &glist);
+void intersect_genes_of_ecs(const std::vector<int32_t> &ecs, const SetTable &ec2genes, std::vector<int32_t> &glist);
+// transcripts of ecs per gene, intersected where that is not empty, in u. Empty if ecs have no genes
+void intersect_ecs_with_genes(const std::vector<int32_t> &ecs, const std::vector<int32_t> &genemap, const SetTable &ecmap, const SetTable &ec2genes, std::vector<int32_t> &u, bool assumeIntersectionIsEmpty = true);
+void create_ec2genes(const SetTable &ecmap, const std::vector<int32_t> &genemap, SetTable &ec2gene);
 
 
 
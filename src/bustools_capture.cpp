@@ -11,23 +11,23 @@ void bustools_capture(Bustools_opt &opt) {
   BUSHeader h;
 
   std::unordered_set<uint64_t> captures;
-  std::vector<std::vector<int32_t>> ecmap;
-  std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> ecmapinv;
+  SetTable ecmap;
+  ECSetMap ecmapinv;
 
   if (opt.type == CAPTURE_TX) {
     // parse ecmap and capture list
     std::unordered_map<std::string, int32_t> txnames;
-    std::cerr << "Parsing transcripts .. "; std::cerr.flush();
-    parseTranscripts(opt.count_txp, txnames);
-    std::cerr << "done" << std::endl;
-    std::cerr << "Parsing ECs .. "; std::cerr.flush();
-    parseECs(opt.count_ecs, h);
+    std::cerr << "Parsing transcripts and ECs .. "; std::cerr.flush();
+    if (!parseECsAndTranscripts(opt.count_ecs, opt.count_txp, opt.stream_in ? "" : opt.files[0], h, txnames)) {
+      std::cerr << std::endl << "Error: missing equivalence classes or transcript names, use -e and -t or a BUS file that embeds them" << std::endl;
+      exit(1);
+    }
     std::cerr << "done" << std::endl;
     ecmap = h.ecs; // copy
 
     ecmapinv.reserve(ecmap.size());
     for (int32_t ec = 0; ec < ecmap.size(); ec++) {
-      ecmapinv.insert({ecmap[ec], ec});
+      ecmapinv.insert(ecmap[ec], ec);
     }
 
     std::cerr << "Parsing capture list .. "; std::cerr.flush();
@@ -60,30 +60,31 @@ void bustools_capture(Bustools_opt &opt) {
   size_t nr = 0, nw = 0;
   size_t N = 100000;
   uint32_t bclen = 0;
-  BUSData* p = new BUSData[N];
+  const BUSData* p = nullptr;
   BUSData bd;
 
   for (const auto& infn : opt.files) { 
 
-    std::streambuf *inbuf;
-    std::ifstream inf;
-    if (!opt.stream_in) {
-      inf.open(infn.c_str(), std::ios::binary);
-      inbuf = inf.rdbuf();
-    } else {
-      inbuf = std::cin.rdbuf();
+    BUSReader reader(infn, opt.stream_in, h, N);
+    if (opt.type == CAPTURE_BC && !opt.complement && !opt.stream_in) {
+      // with an index only the blocks that can hold the captured barcodes are read
+      BUSIndex index;
+      if (parseIndex(infn, index)) {
+        reader.setRanges(indexRanges(index, std::vector<uint64_t>(captures.begin(), captures.end())));
+      }
     }
-    std::istream in(inbuf);          
-    parseHeader(in, h);
 
     if (!outheader_written) {
+      if (opt.filter) {
+        // new ECs are created while filtering, the output ECs are written to a file instead
+        h.ecs.clear();
+      }
       writeHeader(o, h);
       outheader_written = true;
     }
 
     while(true) {
-      in.read((char*)p, N*sizeof(BUSData));
-      size_t rc = in.gcount() / sizeof(BUSData);
+      size_t rc = reader.read(p);
       if (rc == 0) {
         break;
       }
@@ -94,7 +95,7 @@ void bustools_capture(Bustools_opt &opt) {
         bool capt = false;
 
         if (opt.type == CAPTURE_TX) {
-          if (bd.ec < 0 || bd.ec > ecmap.size()) {
+          if (bd.ec < 0 || bd.ec >= (int32_t) ecmap.size()) {
             continue;
           }
           for (auto x : ecmap[bd.ec]) {
@@ -128,16 +129,14 @@ void bustools_capture(Bustools_opt &opt) {
               std::sort(v.begin(), v.end());                  
             }
 
-            auto it = ecmapinv.find(v);
-            if (it == ecmapinv.end()) {
+            int32_t ec = ecmapinv.find(v);
+            if (ec == -1) {
               // create new ec;
-              int32_t ec = ecmap.size();
+              ec = ecmap.size();
               ecmap.push_back(v);
-              ecmapinv.insert({v,ec});
-              bd.ec = ec;
-            } else {
-              bd.ec = it->second;
+              ecmapinv.insert(v, ec);
             }
+            bd.ec = ec;
           }
 
           ++nw;
@@ -145,9 +144,6 @@ void bustools_capture(Bustools_opt &opt) {
         }
       }
     }
-    if (!opt.stream_in) {
-      inf.close();
-    }
   }
 
   if (opt.filter) {
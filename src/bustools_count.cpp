@@ -1,164 +1,676 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <thread>
+#include <functional>
+#include <cstdio>
 
 #include "Common.hpp"
 #include "BUSData.h"
+#include "bustools_sort.h"
 
 #include "bustools_count.h"
 
 
-void bustools_count(Bustools_opt &opt) {
-  BUSHeader h;
-  size_t nr = 0;
-  size_t N = 100000;
-  uint32_t bclen = 0;
-  BUSData* p = new BUSData[N];
+// matrix entries counted by a thread in a batch, row i ends at rows[i]
+struct MatrixRows {
+  std::vector<std::pair<int32_t, double>> entries;
+  std::vector<size_t> rows;
+  TextWriter out;
+  size_t n_entries = 0;
+};
 
-  // read and parse the equivelence class files
+// merges the UMIs of a barcode that are one mismatch apart with the directional method of
+// UMI-tools: UMI a takes UMI b if b has at most (reads of a + 1)/2 reads, and then the UMIs b
+// would take. The UMIs are visited by decreasing number of reads, neighbours are found by trying
+// every substitution in a hash table of the UMIs of the barcode
+class UMICollapser {
+ public:
+  size_t n_umis = 0, n_merged = 0;
 
-  std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> ecmapinv;
-  std::vector<std::vector<int32_t>> ecmap;
+  // records of v[0..n), which is sorted by UMI and EC, with the UMIs merged. Returns v if no UMIs
+  // are merged, otherwise the records are moved to a buffer of their own, sorted and with repeated
+  // ECs of a UMI removed, and n is updated
+  const BUSData *collapse(const BUSData *v, size_t &n, uint32_t umilen) {
+    umis.clear();
+    reads.clear();
+    first.clear();
+    for (size_t i = 0; i < n; i++) {
+      if (i == 0 || v[i].UMI != v[i-1].UMI) {
+        umis.push_back(v[i].UMI);
+        reads.push_back(0);
+        first.push_back(i);
+      }
+      reads.back() += v[i].count;
+    }
+    first.push_back(n);
+    size_t k = umis.size();
+    n_umis += k;
+    if (k < 2) {
+      return v;
+    }
 
-  std::unordered_map<std::string, int32_t> txnames;
-  parseTranscripts(opt.count_txp, txnames);
-  std::vector<int32_t> genemap(txnames.size(), -1);
-  std::unordered_map<std::string, int32_t> genenames;
-  parseGenes(opt.count_genes, txnames, genemap, genenames);
-  parseECs(opt.count_ecs, h);
-  ecmap = std::move(h.ecs);
-  ecmapinv.reserve(ecmap.size());
-  for (int32_t ec = 0; ec < ecmap.size(); ec++) {
-    ecmapinv.insert({ecmap[ec], ec});
-  }
-  std::vector<std::vector<int32_t>> ec2genes;        
-  create_ec2genes(ecmap, genemap, ec2genes);
+    // mostly empty, so a miss is usually a single load
+    slots.assign(std::max<size_t>(rndup(8*k), 64), 0);
+    mask = slots.size() - 1;
+    for (size_t i = 0; i < k; i++) {
+      size_t s = slot(umis[i]);
+      while (slots[s] != 0) {
+        s = (s + 1) & mask;
+      }
+      slots[s] = i + 1;
+    }
+    changes.clear();
+    for (size_t i = 0; i < umilen; i++) {
+      for (uint64_t d = 1; d <= 3; d++) {
+        changes.push_back(d << (2*i));
+      }
+    }
+    uint32_t min_reads = *std::min_element(reads.begin(), reads.end());
 
+    // by decreasing number of reads, then by UMI
+    order.resize(k);
+    for (size_t i = 0; i < k; i++) {
+      order[i] = ((uint64_t) (UINT32_MAX - reads[i]) << 32) | i;
+    }
+    std::sort(order.begin(), order.end());
+    root.assign(k, -1);
+    size_t merged = 0;
+    for (uint64_t o : order) {
+      int32_t r = (uint32_t) o;
+      if (root[r] != -1) {
+        continue;
+      }
+      root[r] = r;
+      stack.push_back(r);
+      while (!stack.empty()) {
+        int32_t x = stack.back();
+        stack.pop_back();
+        uint64_t limit = (uint64_t) reads[x] + 1;
+        if (limit < 2ULL*min_reads) {
+          continue; // x cannot take any UMI
+        }
+        for (uint64_t c : changes) {
+          int32_t y = find(umis[x] ^ c);
+          if (y != -1 && root[y] == -1 && limit >= 2ULL*reads[y]) {
+            root[y] = r;
+            stack.push_back(y);
+            merged++;
+          }
+        }
+      }
+    }
+    n_merged += merged;
+    if (merged == 0) {
+      return v;
+    }
 
-  std::ofstream of;
-  std::string mtx_ofn = opt.output + ".mtx";
-  std::string barcodes_ofn = opt.output + ".barcodes.txt";
-  std::string ec_ofn = opt.output + ".ec.txt";
-  std::string gene_ofn = opt.output + ".genes.txt";
-  of.open(mtx_ofn); 
+    // group the UMIs by the UMI they are merged into, offsets[r] ends up at the end of group r
+    offsets.assign(k + 1, 0);
+    for (size_t i = 0; i < k; i++) {
+      offsets[root[i] + 1]++;
+    }
+    for (size_t i = 0; i < k; i++) {
+      offsets[i + 1] += offsets[i];
+    }
+    members.resize(k);
+    for (size_t i = 0; i < k; i++) {
+      members[offsets[root[i]]++] = i;
+    }
+    out.clear();
+    size_t b = 0;
+    for (size_t r = 0; r < k; r++) {
+      size_t e = offsets[r];
+      if (b == e) {
+        continue;
+      }
+      size_t o = out.size();
+      for (size_t m = b; m < e; m++) {
+        int32_t i = members[m];
+        for (size_t j = first[i]; j < first[i+1]; j++) {
+          out.push_back(v[j]);
+          out.back().UMI = umis[r];
+        }
+      }
+      if (e - b > 1) {
+        // the ECs of the merged UMIs, sorted and without repeats
+        std::sort(out.begin() + o, out.end(), [](const BUSData &x, const BUSData &y) { return x.ec < y.ec; });
+        size_t c = o;
+        for (size_t j = o + 1; j < out.size(); j++) {
+          if (out[j].ec == out[c].ec) {
+            out[c].count += out[j].count;
+          } else {
+            out[++c] = out[j];
+          }
+        }
+        out.resize(c + 1);
+      }
+      b = e;
+    }
+    n = out.size();
+    return out.data();
+  }
 
-  // write out the initial header
-  of << "%%MatrixMarket matrix coordinate real general\n%\n";
-  // number of genes
-  auto mat_header_pos = of.tellp();
-  std::string dummy_header(66, '\n');
-  for (int i = 0; i < 33; i++) {
-    dummy_header[2*i] = '%';
+ private:
+  size_t slot(uint64_t umi) const {
+    return ((umi * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
   }
-  of.write(dummy_header.c_str(), dummy_header.size());
 
+  // index of umi in umis, -1 if the barcode does not have it
+  int32_t find(uint64_t umi) const {
+    for (size_t s = slot(umi); slots[s] != 0; s = (s + 1) & mask) {
+      if (umis[slots[s] - 1] == umi) {
+        return slots[s] - 1;
+      }
+    }
+    return -1;
+  }
 
-  size_t n_cols = 0;
-  size_t n_rows = 0;
-  size_t n_entries = 0;
-  std::vector<BUSData> v;
-  v.reserve(N);
-  uint64_t current_bc = 0xFFFFFFFFFFFFFFFFULL;
+  std::vector<uint64_t> umis; // distinct UMIs of the barcode
+  std::vector<uint32_t> reads; // number of reads of each UMI
+  std::vector<size_t> first; // first record of each UMI
+  std::vector<uint64_t> changes; // the substitutions of a base, xor'ed into a UMI
+  std::vector<uint64_t> order; // reads and index of the UMIs in the order they are visited
+  std::vector<int32_t> root; // UMI each UMI is merged into
+  std::vector<int32_t> stack;
+  std::vector<uint32_t> slots; // index of the UMI + 1, 0 if empty
+  size_t mask = 0;
+  std::vector<size_t> offsets;
+  std::vector<int32_t> members;
+  std::vector<BUSData> out;
+};
+
+// the barcodes of a batch are split into one range per thread. ECs a thread creates by
+// intersecting are numbered from base in that thread, once all threads are done they are added to
+// ecmap in thread order, which gives the same numbering as counting on one thread
+struct CountWorker {
   //temporary data
   std::vector<int32_t> ecs;
   std::vector<int32_t> glist;
-  ecs.reserve(100);
   std::vector<int32_t> u;
-  u.reserve(100);
   std::vector<int32_t> column_v;
   std::vector<std::pair<int32_t, double>> column_vp;
-  if (!opt.count_collapse) {
-    column_v.reserve(N); 
-  } else {
-    column_vp.reserve(N);
-    glist.reserve(100);
-  }
-  //barcodes 
-  std::vector<uint64_t> barcodes;
+
+  // the same ECs recur in many UMIs, so the result for the ECs of a UMI with more than one
+  // record is cached
+  ECSetMap cache;
+  std::vector<std::pair<int32_t, bool>> cached_ecs; // EC and whether it was rescued by genes
+  SetTable cached_genes;
+  size_t cache_hits = 0, cache_misses = 0;
+
+  // ECs created in the batch, base + i is new_ecs[i]
+  int32_t base = 0;
+  SetTable new_ecs;
+  ECSetMap new_ecsinv;
+  SetTable new_genes;
+  std::vector<int32_t> remap; // EC of new_ecs[i] in ecmap
+
+  UMICollapser umis;
+
+  MatrixRows tcc;
+  MatrixRows genes;
+
   int bad_count = 0;
   int compacted = 0;
   int rescued = 0;
+};
 
-  auto write_barcode_matrix = [&](const std::vector<BUSData> &v) {
-    if(v.empty()) {
+// collects the distinct barcode, UMI and EC triples of unsorted records in a hash table. When the
+// table holds as many records as fit in max_memory they are appended to one temporary file per
+// range of barcodes and the table is emptied. The ranges are then read back one at a time, so only
+// the records of one range have to fit in memory, and handed on in sorted order. The ranges are
+// picked from the barcodes in the table when it is first full
+class RecordAggregator {
+ public:
+  RecordAggregator(size_t max_memory, const std::string &temp_prefix)
+    : max_records(std::min<size_t>(max_memory / (sizeof(BUSData) + 4*sizeof(uint32_t)), UINT32_MAX)),
+      temp_prefix(temp_prefix), mask(0), spilled(RANGES, 0) {
+    clear();
+  }
+
+  void add(const BUSData *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (records.size() >= max_records) {
+        spill();
+      }
+      insert(p[i]);
+    }
+  }
+
+  // calls f with the records sorted by barcode, UMI and EC, one range of barcodes after another
+  void finish(const std::function<void(const BUSData *, size_t)> &f) {
+    if (std::all_of(spilled.begin(), spilled.end(), [](size_t n) { return n == 0; })) {
+      emit(f);
       return;
     }
-    column_v.resize(0);
-    n_rows+= 1;
-    
-    barcodes.push_back(v[0].barcode);
-    double val = 0.0;
-    size_t n = v.size();
+    spill();
+    std::vector<BUSData> buf(1ULL << 16);
+    for (size_t r = 0; r < RANGES; r++) {
+      if (spilled[r] == 0) {
+        continue;
+      }
+      std::string fn = temp_prefix + std::to_string(r);
+      std::ifstream in(fn, std::ios::binary);
+      for (size_t left = spilled[r]; left > 0; ) {
+        size_t rc = std::min(left, buf.size());
+        in.read((char*) buf.data(), rc*sizeof(BUSData));
+        check_temp_file(in, fn, "read");
+        add_unbounded(buf.data(), rc);
+        left -= rc;
+      }
+      in.close();
+      std::remove(fn.c_str());
+      emit(f);
+    }
+  }
 
-    for (size_t i = 0; i < n; ) {
-      size_t j = i+1;
-      for (; j < n; j++) {
-        if (v[i].UMI != v[j].UMI) {
-          break;
+ private:
+  static const size_t RANGES = 256;
+
+  // a temporary file that cannot be written or read back in full would lose records, so give up
+  static void check_temp_file(const std::ios &s, const std::string &fn, const char *what) {
+    if (!s) {
+      std::cerr << "Error: could not " << what << " temporary file " << fn << std::endl;
+      exit(1);
+    }
+  }
+
+  static uint64_t hash(const BUSData &b) {
+    uint64_t h = (b.barcode ^ (b.UMI * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    h = (h ^ (h >> 32) ^ (uint32_t) b.ec) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+  }
+
+  size_t range(uint64_t barcode) const {
+    return std::upper_bound(splitters.begin(), splitters.end(), barcode) - splitters.begin();
+  }
+
+  // the first barcodes of ranges 1, 2, ... from a sample of the barcodes in the table
+  void pick_splitters() {
+    std::vector<uint64_t> samples;
+    size_t step = std::max<size_t>(records.size() / (64*RANGES), 1);
+    for (size_t i = 0; i < records.size(); i += step) {
+      samples.push_back(records[i].barcode);
+    }
+    std::sort(samples.begin(), samples.end());
+    for (size_t r = 1; r < RANGES && !samples.empty(); r++) {
+      uint64_t bc = samples[r*samples.size()/RANGES];
+      if (splitters.empty() || bc > splitters.back()) {
+        splitters.push_back(bc);
+      }
+    }
+  }
+
+  void clear() {
+    records.clear();
+    slots.assign(1ULL << 16, 0);
+    mask = slots.size() - 1;
+  }
+
+  void insert(const BUSData &b) {
+    size_t i = hash(b) & mask;
+    while (slots[i] != 0) {
+      auto &x = records[slots[i] - 1];
+      if (x.barcode == b.barcode && x.UMI == b.UMI && x.ec == b.ec) {
+        x.count += b.count;
+        return;
+      }
+      i = (i + 1) & mask;
+    }
+    records.push_back(b);
+    slots[i] = records.size();
+    if (2*records.size() > slots.size()) {
+      // keep the table at most half full
+      slots.assign(2*slots.size(), 0);
+      mask = slots.size() - 1;
+      for (size_t k = 0; k < records.size(); k++) {
+        size_t j = hash(records[k]) & mask;
+        while (slots[j] != 0) {
+          j = (j + 1) & mask;
         }
+        slots[j] = k + 1;
       }
+    }
+  }
 
-      // v[i..j-1] share the same UMI
-      ecs.resize(0);
-      for (size_t k = i; k < j; k++) {
-        ecs.push_back(v[k].ec);
+  // a range read back from disk is kept whole even if it is larger than max_memory
+  void add_unbounded(const BUSData *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      insert(p[i]);
+    }
+  }
+
+  // appends the records to the file of their range
+  void spill() {
+    if (splitters.empty()) {
+      pick_splitters();
+    }
+    std::vector<size_t> offset(RANGES + 1, 0);
+    for (const auto &b : records) {
+      offset[range(b.barcode) + 1]++;
+    }
+    for (size_t r = 0; r < RANGES; r++) {
+      offset[r+1] += offset[r];
+    }
+    std::vector<BUSData> tmp(records.size());
+    std::vector<size_t> pos(offset.begin(), offset.end() - 1);
+    for (const auto &b : records) {
+      tmp[pos[range(b.barcode)]++] = b;
+    }
+    for (size_t r = 0; r < RANGES; r++) {
+      if (offset[r] == offset[r+1]) {
+        continue;
       }
+      // the first spill of a range replaces whatever file is there
+      std::string fn = temp_prefix + std::to_string(r);
+      std::ofstream out(fn, std::ios::binary | (spilled[r] == 0 ? std::ios::trunc : std::ios::app));
+      out.write((char*) (tmp.data() + offset[r]), (offset[r+1] - offset[r])*sizeof(BUSData));
+      out.close();
+      check_temp_file(out, fn, "write");
+      spilled[r] += offset[r+1] - offset[r];
+    }
+    clear();
+  }
 
-      int32_t ec = intersect_ecs(ecs, u, ecmap, ecmapinv);
-      if (ec == -1) {
-        ec = intersect_ecs_with_genes(ecs, genemap, ecmap, ecmapinv, ec2genes);              
-        if (ec == -1) {
-          bad_count += j-i;
+  void emit(const std::function<void(const BUSData *, size_t)> &f) {
+    std::vector<BUSData> tmp(records.size());
+    BUSData *r = radix_sort(records.data(), records.size(), tmp.data());
+    f(r, records.size());
+    clear();
+  }
+
+  const size_t max_records;
+  const std::string temp_prefix;
+  std::vector<uint64_t> splitters;
+  std::vector<BUSData> records;
+  std::vector<uint32_t> slots; // index of the record + 1, 0 if empty
+  size_t mask;
+  std::vector<size_t> spilled; // number of records in the temporary file of each range
+};
+
+// a count matrix written as Matrix Market to <prefix>.mtx or in binary to <prefix>.bin
+class MatrixFile {
+ public:
+  MatrixFile() : binary(false), float_values(false), header_written(false) {}
+
+  void open(const std::string &prefix, bool binary, bool float_values) {
+    this->binary = binary;
+    this->float_values = float_values;
+    if (!binary) {
+      fn = prefix + ".mtx";
+      of.open(fn);
+
+      // write out the initial header
+      of << "%%MatrixMarket matrix coordinate real general\n%\n";
+      // number of genes
+      header_pos = of.tellp();
+      std::string dummy_header(66, '\n');
+      for (int i = 0; i < 33; i++) {
+        dummy_header[2*i] = '%';
+      }
+      of.write(dummy_header.c_str(), dummy_header.size());
+    } else {
+      // the header is written with the first block, once the barcode length is known
+      fn = prefix + ".bin";
+      of.open(fn, std::ios::out | std::ios::binary);
+    }
+  }
+
+  // writes the rows m of the workers, text rows are already formatted, barcodes[i] is the barcode
+  // of row i
+  void writeRows(const std::vector<CountWorker> &workers, MatrixRows CountWorker::*m, const uint64_t *barcodes, uint32_t nrows, uint32_t bclen) {
+    if (!binary) {
+      for (const auto &w : workers) {
+        of.write((w.*m).out.data(), (w.*m).out.size());
+      }
+      return;
+    }
+    write_bin_header(bclen);
+    uint32_t nnz = 0;
+    for (const auto &w : workers) {
+      nnz += (w.*m).entries.size();
+    }
+    of.write((char*)(&nrows), sizeof(nrows));
+    of.write((char*)(&nnz), sizeof(nnz));
+    of.write((char*) barcodes, nrows*sizeof(uint64_t));
+    buf.clear();
+    for (const auto &w : workers) {
+      size_t b = 0;
+      for (size_t e : (w.*m).rows) {
+        buf.push_back(e - b);
+        b = e;
+      }
+    }
+    for (const auto &w : workers) {
+      for (const auto &x : (w.*m).entries) {
+        buf.push_back(x.first);
+      }
+    }
+    for (const auto &w : workers) {
+      for (const auto &x : (w.*m).entries) {
+        if (float_values) {
+          float f = x.second;
+          uint32_t v;
+          std::memcpy(&v, &f, sizeof(v));
+          buf.push_back(v);
         } else {
-          bool filter = false;
-          if (!opt.count_gene_multimapping) {
-            filter = (ec2genes[ec].size() != 1);
-          }
-          if (!filter) {
-            rescued += j-i;
-            column_v.push_back(ec);
-          }
+          buf.push_back((uint32_t) x.second);
         }
+      }
+    }
+    of.write((char*) buf.data(), buf.size()*sizeof(uint32_t));
+  }
+
+  // fills in the size of the matrix, names are the names of the columns if there are any
+  void close(size_t n_rows, size_t n_cols, size_t n_entries, const std::vector<std::string> &names, uint32_t bclen) {
+    if (!binary) {
+      of.close();
+
+      std::stringstream ss;
+      ss << n_rows << " " << n_cols << " " << n_entries << "\n";
+      std::string header = ss.str();
+      int hlen = header.size();
+      assert(hlen < 66);
+      of.open(fn, std::ios::binary | std::ios::in | std::ios::out);
+      of.seekp(header_pos);
+      of.write("%",1);
+      of.write(std::string(66-hlen-2,' ').c_str(),66-hlen-2);
+      of.write("\n",1);
+      of.write(header.c_str(), hlen);
+      of.close();
+    } else {
+      // an empty block ends the matrix, the totals and column names follow it
+      write_bin_header(bclen);
+      uint32_t zero = 0;
+      of.write((char*)(&zero), sizeof(zero));
+      of.write((char*)(&zero), sizeof(zero));
+      uint64_t totals[3] = {n_rows, n_cols, n_entries};
+      of.write((char*) totals, sizeof(totals));
+      uint32_t nnames = names.size();
+      of.write((char*)(&nnames), sizeof(nnames));
+      for (const auto &name : names) {
+        uint32_t len = name.size();
+        of.write((char*)(&len), sizeof(len));
+        of.write(name.data(), len);
+      }
+      of.close();
+    }
+  }
+
+ private:
+  void write_bin_header(uint32_t bclen) {
+    if (header_written) {
+      return;
+    }
+    // the values are float only when a UMI is split between genes
+    uint32_t value_type = float_values ? 1 : 0;
+    of.write("BUSM", 4);
+    of.write((char*)(&BUSMATRIX_VERSION), sizeof(BUSMATRIX_VERSION));
+    of.write((char*)(&value_type), sizeof(value_type));
+    of.write((char*)(&bclen), sizeof(bclen));
+    header_written = true;
+  }
+
+  std::ofstream of;
+  std::string fn;
+  bool binary;
+  bool float_values;
+  std::streampos header_pos;
+  bool header_written;
+  std::vector<uint32_t> buf;
+};
+
+void bustools_count(Bustools_opt &opt) {
+  BUSHeader h;
+  size_t nr = 0;
+  size_t N = 100000;
+  uint32_t bclen = 0;
+  uint32_t umilen = 0;
+  const BUSData* p = nullptr;
+
+  // read and parse the equivelence class files
+
+  ECSetMap ecmapinv;
+  SetTable ecmap;
+
+  ECIndex index;
+  if (!loadECIndex(opt.count_ecs, opt.count_txp, opt.count_genes, opt.stream_in ? "" : opt.files[0], index)) {
+    std::cerr << "Error: missing equivalence classes or transcript names, use -e and -t or a BUS file that embeds them" << std::endl;
+    exit(1);
+  }
+  std::vector<int32_t> genemap = std::move(index.genemap);
+  std::unordered_map<std::string, int32_t> genenames;
+  for (int32_t g = 0; g < (int32_t) index.genes.size(); g++) {
+    genenames.insert({index.genes[g], g});
+  }
+  ecmap = std::move(index.ecs);
+  ecmapinv.reserve(ecmap.size());
+  for (int32_t ec = 0; ec < ecmap.size(); ec++) {
+    ecmapinv.insert(ecmap[ec], ec);
+  }
+  SetTable ec2genes = std::move(index.ec2genes);
+  // records with ECs outside of the input classes are bad
+  const int32_t n_ecs = ecmap.size();
+
+  // the TCC matrix, the gene matrix or both from the same pass over the records
+  const bool count_tcc = !opt.count_collapse || opt.count_tcc_and_genes;
+  const bool count_genes = opt.count_collapse || opt.count_tcc_and_genes;
 
+  std::string barcodes_ofn = opt.output + ".barcodes.txt";
+  std::string ec_ofn = opt.output + ".ec.txt";
+  std::string gene_ofn = opt.output + ".genes.txt";
+  MatrixFile tcc_of, gene_of;
+  if (count_tcc) {
+    tcc_of.open(opt.output, opt.count_binary, false);
+  }
+  if (count_genes) {
+    gene_of.open(count_tcc ? opt.output + ".genes" : opt.output, opt.count_binary, opt.count_gene_multimapping);
+  }
+
+  size_t n_rows = 0;
+  //barcodes
+  std::vector<uint64_t> barcodes;
+
+  int nthreads = std::max(opt.threads, 1);
+  std::vector<CountWorker> workers(nthreads);
+  // the cache of each thread is emptied when it holds CACHE_MAX results
+  const size_t CACHE_MAX = 1ULL << 22;
+  for (auto &w : workers) {
+    w.ecs.reserve(100);
+    w.u.reserve(100);
+    w.glist.reserve(100);
+  }
+  auto cache_insert = [&](CountWorker &w, const std::vector<int32_t> &ecs) {
+    w.cache_misses++;
+    if (w.cache.size() >= CACHE_MAX) {
+      w.cache.clear();
+      w.cached_ecs.clear();
+      w.cached_genes.clear();
+    }
+    w.cache.insert(ecs, w.cache.size());
+  };
+
+  // EC of the transcripts in u, a new EC of the thread if they are not a class yet. A single
+  // thread adds its ECs to ecmap right away
+  auto find_ec = [&](CountWorker &w, const std::vector<int32_t> &u) -> int32_t {
+    if (u.empty()) {
+      return -1;
+    }
+    int32_t ec = ecmapinv.find(u);
+    if (ec == -1 && nthreads > 1) {
+      ec = w.new_ecsinv.find(u);
+    }
+    if (ec == -1) {
+      // create new equivalence class
+      w.glist.clear();
+      vt2gene(SetTable::Set(u.data(), u.data() + u.size()), genemap, w.glist);
+      if (nthreads > 1) {
+        ec = w.base + w.new_ecs.size();
+        w.new_ecs.push_back(u);
+        w.new_ecsinv.insert(u, ec);
+        w.new_genes.push_back(w.glist);
       } else {
-        bool filter = false;
-        if (!opt.count_gene_multimapping) {
-          filter = (ec2genes[ec].size() != 1);
-        }
-        if (!filter) {
-          compacted += j-i-1;
-          column_v.push_back(ec);
+        ec = ecmap.size();
+        ecmap.push_back(u);
+        ecmapinv.insert(u, ec);
+        ec2genes.push_back(w.glist);
+      }
+    }
+    return ec;
+  };
+
+  // genes of an EC created by w in this batch or before
+  auto genes_of = [&](const CountWorker &w, int32_t ec) {
+    return ec < (int32_t) ec2genes.size() ? ec2genes[ec] : w.new_genes[ec - w.base];
+  };
+
+  // EC of the UMI with the ECs w.ecs from n records
+  auto count_umi_tcc = [&](CountWorker &w, int32_t ec, bool rescue, size_t n) {
+    if (ec == -1) {
+      w.bad_count += n;
+    } else {
+      bool filter = false;
+      if (!opt.count_gene_multimapping) {
+        filter = (genes_of(w, ec).size() != 1);
+      }
+      if (!filter) {
+        if (rescue) {
+          w.rescued += n;
+        } else {
+          w.compacted += n-1;
         }
+        w.column_v.push_back(ec);
       }
-      i = j; // increment
     }
-    std::sort(column_v.begin(), column_v.end());
-    size_t m = column_v.size();
-    for (size_t i = 0; i < m; ) {
-      size_t j = i+1;
-      for (; j < m; j++) {
-        if (column_v[i] != column_v[j]) {
-          break;
+  };
+
+  // genes of the UMI in w.glist
+  auto count_umi_genes = [&](CountWorker &w) {
+    auto &glist = w.glist;
+    int gn = glist.size();
+    if (gn > 0) {
+      if (opt.count_gene_multimapping) {
+        for (auto x : glist) {
+          w.column_vp.push_back({x, 1.0/gn});
+        }
+      } else {
+        if (gn==1) {
+          w.column_vp.push_back({glist[0],1.0});
         }
       }
-      double val = j-i;
-      of << n_rows << " " << (column_v[i]+1) << " " << val << "\n";
-      n_entries++;
-      
-      i = j; // increment
     }
   };
 
-  auto write_barcode_matrix_collapsed = [&](const std::vector<BUSData> &v) {
-    if(v.empty()) {
-      return;
+  // counts the records v[0..n) of one barcode, the UMIs are grouped once for both matrices
+  auto write_barcode_matrix = [&](CountWorker &w, const BUSData *v, size_t n) {
+    if (opt.count_umi_correct) {
+      v = w.umis.collapse(v, n, umilen);
     }
-    column_vp.resize(0);
-    n_rows+= 1;
-    
-    barcodes.push_back(v[0].barcode);
-    double val = 0.0;
-    size_t n = v.size();
+    auto &ecs = w.ecs;
+    auto &u = w.u;
+    auto &glist = w.glist;
+    w.column_v.resize(0);
+    w.column_vp.resize(0);
 
     for (size_t i = 0; i < n; ) {
       size_t j = i+1;
@@ -170,134 +682,332 @@ void bustools_count(Bustools_opt &opt) {
 
       // v[i..j-1] share the same UMI
       ecs.resize(0);
+      bool valid = true;
       for (size_t k = i; k < j; k++) {
         ecs.push_back(v[k].ec);
+        valid = valid && v[k].ec >= 0 && v[k].ec < n_ecs;
       }
 
-      intersect_genes_of_ecs(ecs,ec2genes, glist);
-      int gn = glist.size();
-      if (gn > 0) {
-        if (opt.count_gene_multimapping) {
-          for (auto x : glist) {
-            column_vp.push_back({x, 1.0/gn});
+      int32_t ec = -1;
+      bool rescue = false;
+      int32_t c = ecs.size() > 1 ? w.cache.find(ecs) : -1;
+      if (c != -1) {
+        w.cache_hits++;
+        if (count_tcc) {
+          ec = w.cached_ecs[c].first;
+          rescue = w.cached_ecs[c].second;
+        }
+        if (count_genes) {
+          auto g = w.cached_genes[c];
+          glist.assign(g.begin(), g.end());
+        }
+      } else {
+        if (count_tcc && valid) {
+          if (ecs.size() == 1) {
+            ec = ecs[0]; // no work
+          } else {
+            intersect_ecs(ecs, u, ecmap);
+            ec = find_ec(w, u);
+            if (ec == -1) {
+              intersect_ecs_with_genes(ecs, genemap, ecmap, ec2genes, u);
+              ec = find_ec(w, u);
+              rescue = true;
+            }
           }
-        } else {
-          if (gn==1) {
-            column_vp.push_back({glist[0],1.0});
+        }
+        if (count_genes) {
+          intersect_genes_of_ecs(ecs,ec2genes, glist);
+        }
+        if (ecs.size() > 1 && (valid || !count_tcc)) {
+          cache_insert(w, ecs);
+          if (count_tcc) {
+            w.cached_ecs.push_back({ec, rescue});
+          }
+          if (count_genes) {
+            w.cached_genes.push_back(glist);
           }
         }
       }
+
+      if (count_tcc) {
+        count_umi_tcc(w, ec, rescue, j-i);
+      }
+      if (count_genes) {
+        count_umi_genes(w);
+      }
       i = j; // increment
     }
-    std::sort(column_vp.begin(), column_vp.end());
-    size_t m = column_vp.size();
-    for (size_t i = 0; i < m; ) {
-      size_t j = i+1;
-      double val = column_vp[i].second;
-      for (; j < m; j++) {
-        if (column_vp[i].first != column_vp[j].first) {
-          break;
+
+    if (count_tcc) {
+      auto &column_v = w.column_v;
+      std::sort(column_v.begin(), column_v.end());
+      size_t m = column_v.size();
+      for (size_t i = 0; i < m; ) {
+        size_t j = i+1;
+        for (; j < m; j++) {
+          if (column_v[i] != column_v[j]) {
+            break;
+          }
         }
-        val += column_vp[j].second;
+        double val = j-i;
+        w.tcc.entries.push_back({column_v[i], val});
+
+        i = j; // increment
       }
-      of << n_rows << " " << (column_vp[i].first+1) << " " << val << "\n";
-      n_entries++;
-      
-      i = j; // increment
+      w.tcc.rows.push_back(w.tcc.entries.size());
+    }
+
+    if (count_genes) {
+      auto &column_vp = w.column_vp;
+      std::sort(column_vp.begin(), column_vp.end());
+      size_t m = column_vp.size();
+      for (size_t i = 0; i < m; ) {
+        size_t j = i+1;
+        double val = column_vp[i].second;
+        for (; j < m; j++) {
+          if (column_vp[i].first != column_vp[j].first) {
+            break;
+          }
+          val += column_vp[j].second;
+        }
+        w.genes.entries.push_back({column_vp[i].first, val});
+
+        i = j; // increment
+      }
+      w.genes.rows.push_back(w.genes.entries.size());
     }
   };
 
-  for (const auto& infn : opt.files) { 
-    std::streambuf *inbuf;
-    std::ifstream inf;
-    if (!opt.stream_in) {
-      inf.open(infn.c_str(), std::ios::binary);
-      inbuf = inf.rdbuf();
-    } else {
-      inbuf = std::cin.rdbuf();
-    }
-    std::istream in(inbuf); 
-
-    parseHeader(in, h);
-    bclen = h.bclen;
-    
-    int rc = 0;
-    while (true) {
-      in.read((char*)p, N*sizeof(BUSData));
-      size_t rc = in.gcount() / sizeof(BUSData);
-      nr += rc;
-      if (rc == 0) {
-        break;
+  // runs job(t) for every thread t, the first on this thread
+  auto run_workers = [&](const std::function<void(int)> &job) {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nthreads; t++) {
+      threads.emplace_back(job, t);
+    }
+    job(0);
+    for (auto &t : threads) {
+      t.join();
+    }
+  };
+
+  // records of complete barcodes, batch[starts[i]..starts[i+1]) is the i-th barcode
+  std::vector<BUSData> batch;
+  std::vector<size_t> starts;
+  const size_t batch_size = 4 * N * nthreads;
+  batch.reserve(batch_size + N);
+  std::vector<size_t> split(nthreads + 1);
+
+  // renumbers the new ECs of the rows m if renumber and formats them as text, row is the number of
+  // the first
+  auto format_rows = [&](CountWorker &w, MatrixRows &m, bool renumber, int32_t base, size_t row) {
+    auto &o = m.out;
+    o.clear();
+    size_t b = 0;
+    for (size_t e : m.rows) {
+      row++;
+      bool renumbered = false;
+      for (size_t i = b; i < e && renumber; i++) {
+        if (m.entries[i].first >= base) {
+          m.entries[i].first = w.remap[m.entries[i].first - base];
+          renumbered = true;
+        }
       }
+      if (renumbered) {
+        std::sort(m.entries.begin() + b, m.entries.begin() + e);
+      }
+      for (size_t i = b; i < e && !opt.count_binary; i++) {
+        o.writeUInt(row).put(' ').writeInt(m.entries[i].first+1).put(' ').writeDouble(m.entries[i].second).put('\n');
+      }
+      m.n_entries += e - b;
+      b = e;
+    }
+  };
 
-      
-      for (size_t i = 0; i < rc; i++) {
-        if (p[i].barcode != current_bc) {                 
-          // output whatever is in v
-          if (!v.empty()) {
-            if (!opt.count_collapse) {
-              write_barcode_matrix(v);
-            } else {
-              write_barcode_matrix_collapsed(v);
-            }
-          }
-          v.clear();
-          current_bc = p[i].barcode;
+  auto count_batch = [&]() {
+    if (batch.empty()) {
+      return;
+    }
+    size_t nbc = starts.size();
+    starts.push_back(batch.size());
+    // ranges of about the same number of records
+    split[0] = 0;
+    size_t b = 0;
+    for (int t = 1; t < nthreads; t++) {
+      while (b < nbc && starts[b] < batch.size() * t / nthreads) {
+        b++;
+      }
+      split[t] = b;
+    }
+    split[nthreads] = nbc;
+    const int32_t base = ecmap.size();
+
+    run_workers([&](int t) {
+      auto &w = workers[t];
+      w.base = base;
+      for (auto m : {&w.tcc, &w.genes}) {
+        m->entries.clear();
+        m->rows.clear();
+      }
+      for (size_t b = split[t]; b < split[t+1]; b++) {
+        write_barcode_matrix(w, &batch[starts[b]], starts[b+1] - starts[b]);
+      }
+    });
+
+    // add the new ECs in thread order, a single thread has added them already
+    for (auto &w : workers) {
+      if (nthreads == 1) {
+        break;
+      }
+      w.remap.resize(w.new_ecs.size());
+      for (size_t i = 0; i < w.new_ecs.size(); i++) {
+        auto s = w.new_ecs[i];
+        int32_t ec = ecmapinv.find(s);
+        if (ec == -1) {
+          ec = ecmap.size();
+          ecmap.push_back(s);
+          ecmapinv.insert(s, ec);
+          ec2genes.push_back(w.new_genes[i]);
         }
-        v.push_back(p[i]);
+        w.remap[i] = ec;
+      }
+      for (auto &x : w.cached_ecs) {
+        if (x.first >= base) {
+          x.first = w.remap[x.first - base];
+        }
+      }
+      w.new_ecs.clear();
+      w.new_ecsinv.clear();
+      w.new_genes.clear();
+    }
 
-      }            
+    run_workers([&](int t) {
+      auto &w = workers[t];
+      if (count_tcc) {
+        format_rows(w, w.tcc, nthreads > 1, base, n_rows + split[t]);
+      }
+      if (count_genes) {
+        format_rows(w, w.genes, false, base, n_rows + split[t]);
+      }
+    });
+
+    for (size_t b = 0; b < nbc; b++) {
+      barcodes.push_back(batch[starts[b]].barcode);
     }
-    if (!v.empty()) {
-      if (!opt.count_collapse) {
-        write_barcode_matrix(v);
-      } else {
-        write_barcode_matrix_collapsed(v);
+    if (count_tcc) {
+      tcc_of.writeRows(workers, &CountWorker::tcc, &barcodes[n_rows], nbc, bclen);
+    }
+    if (count_genes) {
+      gene_of.writeRows(workers, &CountWorker::genes, &barcodes[n_rows], nbc, bclen);
+    }
+    n_rows += nbc;
+    batch.clear();
+    starts.clear();
+  };
+
+  uint64_t current_bc = 0xFFFFFFFFFFFFFFFFULL;
+  auto add_records = [&](const BUSData *p, size_t rc) {
+    for (size_t i = 0; i < rc; i++) {
+      if (p[i].barcode != current_bc || batch.empty()) {
+        // a batch ends before a barcode
+        if (batch.size() >= batch_size) {
+          count_batch();
+        }
+        starts.push_back(batch.size());
+        current_bc = p[i].barcode;
+      }
+      batch.push_back(p[i]);
+    }
+  };
+
+  // the input files are read as one stream of records
+  if (!opt.count_unsorted) {
+    for (const auto& infn : opt.files) {
+      BUSReader reader(infn, opt.stream_in, h, N);
+      bclen = h.bclen;
+      umilen = h.umilen;
+
+      while (true) {
+        size_t rc = reader.read(p);
+        nr += rc;
+        if (rc == 0) {
+          break;
+        }
+        add_records(p, rc);
       }
     }
+  } else {
+    RecordAggregator records(opt.max_memory, opt.temp_files);
+    for (const auto& infn : opt.files) {
+      BUSReader reader(infn, opt.stream_in, h, N);
+      bclen = h.bclen;
+      umilen = h.umilen;
 
-    if (!opt.stream_in) {
-      inf.close();
+      while (true) {
+        size_t rc = reader.read(p);
+        nr += rc;
+        if (rc == 0) {
+          break;
+        }
+        records.add(p, rc);
+      }
     }
+    records.finish(add_records);
   }
-  delete[] p; p = nullptr;
+  count_batch();
 
-  if (!opt.count_collapse) {
-    n_cols = ecmap.size();
-  } else {
-    n_cols = genenames.size();
-  }
-
-  of.close();
-  
-  std::stringstream ss;
-  ss << n_rows << " " << n_cols << " " << n_entries << "\n";
-  std::string header = ss.str();
-  int hlen = header.size();
-  assert(hlen < 66);
-  of.open(mtx_ofn, std::ios::binary | std::ios::in | std::ios::out);
-  of.seekp(mat_header_pos);
-  of.write("%",1);
-  of.write(std::string(66-hlen-2,' ').c_str(),66-hlen-2);
-  of.write("\n",1);
-  of.write(header.c_str(), hlen);
-  of.close();
+  size_t tcc_entries = 0, gene_entries = 0;
+  for (const auto &w : workers) {
+    tcc_entries += w.tcc.n_entries;
+    gene_entries += w.genes.n_entries;
+  }
+  if (count_tcc) {
+    tcc_of.close(n_rows, ecmap.size(), tcc_entries, std::vector<std::string>(), bclen);
+  }
+  if (count_genes) {
+    gene_of.close(n_rows, genenames.size(), gene_entries, index.genes, bclen);
+  }
 
   // write updated ec file
   h.ecs = std::move(ecmap);
-  if (!opt.count_collapse) {
+  if (count_tcc) {
     writeECs(ec_ofn, h);
-  } else {
+  }
+  if (count_genes) {
     writeGenes(gene_ofn, genenames);
   }
   // write barcode file
   std::ofstream bcof;
   bcof.open(barcodes_ofn);
+  TextWriter bco(&bcof);
   for (const auto &x : barcodes) {
-    bcof << binaryToString(x, bclen) << "\n";
+    bco.writeSequence(x, bclen).put('\n');
   }
+  bco.flush();
   bcof.close();
+  int bad_count = 0;
+  int compacted = 0;
+  int rescued = 0;
+  size_t cache_hits = 0, cache_misses = 0;
+  for (const auto &w : workers) {
+    bad_count += w.bad_count;
+    compacted += w.compacted;
+    rescued += w.rescued;
+    cache_hits += w.cache_hits;
+    cache_misses += w.cache_misses;
+  }
+  if (opt.count_umi_correct) {
+    size_t n_umis = 0, n_merged = 0;
+    for (const auto &w : workers) {
+      n_umis += w.umis.n_umis;
+      n_merged += w.umis.n_merged;
+    }
+    std::cerr << "Merged " << n_merged << " of " << n_umis << " UMIs into UMIs one mismatch away" << std::endl;
+  }
   //std::cerr << "bad counts = " << bad_count <<", rescued  =" << rescued << ", compacted = " << compacted << std::endl;
+  if (cache_hits + cache_misses > 0) {
+    std::cerr << "EC intersection cache: " << cache_hits << " hits, " << cache_misses << " misses ("
+      << (100.0 * cache_hits / (cache_hits + cache_misses)) << "% hit rate)" << std::endl;
+  }
 
   //std::cerr << "Read in " << nr << " BUS records" << std::endl;
 }
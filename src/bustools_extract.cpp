@@ -0,0 +1,69 @@
+#include <iostream>
+#include <fstream>
+#include <unordered_set>
+
+#include "Common.hpp"
+#include "BUSData.h"
+
+#include "bustools_extract.h"
+
+void bustools_extract(Bustools_opt &opt) {
+  BUSHeader h;
+  std::unordered_set<uint64_t> barcodes;
+  parseUMIBcCaptureList(opt.capture, barcodes);
+  std::vector<uint64_t> bcs(barcodes.begin(), barcodes.end());
+
+  std::streambuf *buf = nullptr;
+  std::ofstream of;
+  if (!opt.stream_out) {
+    of.open(opt.output, std::ios::out | std::ios::binary);
+    buf = of.rdbuf();
+  } else {
+    buf = std::cout.rdbuf();
+  }
+  std::ostream o(buf);
+
+  bool outheader_written = false;
+  size_t nr = 0, nw = 0;
+  size_t N = 100000;
+  const BUSData *p = nullptr;
+
+  for (const auto& infn : opt.files) {
+    BUSReader reader(infn, opt.stream_in, h, N);
+    if (!opt.stream_in) {
+      // only the blocks that can hold the barcodes are read
+      BUSIndex index;
+      if (parseIndex(infn, index)) {
+        reader.setRanges(indexRanges(index, bcs));
+      } else {
+        std::cerr << "Warning: no index found for " << infn << ", reading the whole file" << std::endl;
+      }
+    }
+
+    if (!outheader_written) {
+      writeHeader(o, h);
+      outheader_written = true;
+    }
+
+    while (true) {
+      size_t rc = reader.read(p);
+      if (rc == 0) {
+        break;
+      }
+      nr += rc;
+
+      for (size_t i = 0; i < rc; i++) {
+        if (barcodes.count(p[i].barcode) > 0) {
+          o.write((char *) &p[i], sizeof(BUSData));
+          ++nw;
+        }
+      }
+    }
+  }
+
+  if (!opt.stream_out) {
+    of.close();
+  }
+
+  std::cerr << "Read in " << nr << " BUS records, wrote " << nw << " BUS records" << std::endl;
+}
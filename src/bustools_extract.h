@@ -0,0 +1,3 @@
+#include "Common.hpp"
+
+void bustools_extract(Bustools_opt &opt);
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <fstream>
+
+#include "Common.hpp"
+#include "BUSData.h"
+
+#include "bustools_index.h"
+
+void bustools_index(Bustools_opt &opt) {
+  ECIndex index;
+  if (!loadECIndex(opt.count_ecs, opt.count_txp, opt.count_genes, "", index)) {
+    std::cerr << "Error: could not read the equivalence classes or transcript names" << std::endl;
+    exit(1);
+  }
+  if (!writeECIndex(opt.output, index)) {
+    std::cerr << "Error: could not write the index " << opt.output << std::endl;
+    exit(1);
+  }
+  std::cerr << "Wrote index of " << index.ecs.size() << " ECs, " << index.transcripts.size() << " transcripts and " << index.genes.size() << " genes" << std::endl;
+}
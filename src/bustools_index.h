@@ -0,0 +1,3 @@
+#include "Common.hpp"
+
+void bustools_index(Bustools_opt &opt);
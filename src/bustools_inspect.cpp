@@ -38,10 +38,12 @@ void bustools_inspect(Bustools_opt &opt) {
   BUSHeader h;
 
   /* Load matrix.ec. */
-  std::vector<std::vector<int32_t>> ecmap;
+  SetTable ecmap;
   if (opt.count_ecs.size()) {
     parseECs(opt.count_ecs, h);
     ecmap = std::move(h.ecs);
+  } else if (!opt.stream_in && readHeader(opt.files[0], h)) {
+    ecmap = std::move(h.ecs);
   }
   int32_t numTargets = 0;
   for (const auto &ec : ecmap) {
@@ -64,18 +66,8 @@ void bustools_inspect(Bustools_opt &opt) {
 
   /* Inspect. */
   size_t N = 100000;
-  BUSData *p = new BUSData[N];
-
-  std::streambuf *inbuf;
-  std::ifstream inf;
-  if (!opt.stream_in) {
-    inf.open(opt.files[0].c_str(), std::ios::binary);
-    inbuf = inf.rdbuf();
-  } else {
-    inbuf = std::cin.rdbuf();
-  }
-  std::istream in(inbuf);
-  parseHeader(in, h);
+  const BUSData *p = nullptr;
+  BUSReader reader(opt.files[0], opt.stream_in, h, N);
 
   /* Number of records. */
   size_t nr = 0;
@@ -116,8 +108,7 @@ void bustools_inspect(Bustools_opt &opt) {
 
   /* Process records. */
     
-  in.read((char*) p, N * sizeof(BUSData));
-  size_t rc = in.gcount() / sizeof(BUSData);
+  size_t rc = reader.read(p);
   nr += rc;
 
   if (rc > 0) {
@@ -185,8 +176,7 @@ void bustools_inspect(Bustools_opt &opt) {
     }
     /* Done going through BUSData *p. */
     
-    in.read((char*) p, N * sizeof(BUSData));
-    rc = in.gcount() / sizeof(BUSData);
+    rc = reader.read(p);
     nr += rc;
 
   }
@@ -198,8 +188,6 @@ void bustools_inspect(Bustools_opt &opt) {
   }
   umisPerBc.push_back(umisPerBc_count);
 
-  delete[] p; p = nullptr;
-
   /* Some computation. */
   size_t s;
   
@@ -304,11 +292,11 @@ void bustools_inspect(Bustools_opt &opt) {
       << to_json("medianUMIsPerBarcode", std::to_string(umisPerBcMed), false) << std::endl
       << to_json("meanUMIsPerBarcode", std::to_string((double) umi_count / bc_count), false) << std::endl
 
-      << to_json("gtRecords", std::to_string(gt_records), false, opt.count_ecs.size() || opt.whitelist.size()) << std::endl
+      << to_json("gtRecords", std::to_string(gt_records), false, !ecmap.empty() || opt.whitelist.size()) << std::endl
 
       << std::flush;
 
-    if (opt.count_ecs.size()) {
+    if (!ecmap.empty()) {
       of
         << to_json("numTargets", std::to_string(targetsDetected), false) << std::endl
         << to_json("medianTargetsPerSet", std::to_string(targetsPerSetMed), false) << std::endl
@@ -359,7 +347,7 @@ void bustools_inspect(Bustools_opt &opt) {
 
       << std::flush;
 
-    if (opt.count_ecs.size()) {
+    if (!ecmap.empty()) {
       std::cout
         << "Number of distinct targets detected: " << std::to_string(targetsDetected) << std::endl
         << "Median number of targets per set: " << std::to_string(targetsPerSetMed) << std::endl
@@ -24,7 +24,7 @@ void bustools_linker(Bustools_opt &opt) {
   size_t nr = 0;
   size_t nw = 0;
   size_t N = 100000;
-  BUSData *p = new BUSData[N];
+  const BUSData *p = nullptr;
   uint32_t bclen = 0;
   int start, end, preShift;
   uint64_t preMask, sufMask;
@@ -32,16 +32,7 @@ void bustools_linker(Bustools_opt &opt) {
   auto infn = opt.files.begin();
 
   do {
-    std::streambuf *inbuf;
-    std::ifstream inf;
-    if (!opt.stream_in) {
-      inf.open(infn->c_str(), std::ios::binary);
-      inbuf = inf.rdbuf();
-    } else {
-      inbuf = std::cin.rdbuf();
-    }
-    std::istream in(inbuf);
-    parseHeader(in, h);
+    BUSReader reader(*infn, opt.stream_in, h, N);
     
     if (bclen == 0) {
       bclen = h.bclen;
@@ -75,20 +66,21 @@ void bustools_linker(Bustools_opt &opt) {
       continue;
     }
     
+    BUSData bd;
     while (true) {
-      in.read((char*) p, N * sizeof(BUSData));
-      size_t rc = in.gcount() / sizeof(BUSData);
+      size_t rc = reader.read(p);
       if (rc == 0) {
         break;
       }
       nr += rc;
 
       for (size_t i = 0; i < rc; i++) {
-        uint64_t prefix = p[i].barcode & preMask;
+        bd = p[i];
+        uint64_t prefix = bd.barcode & preMask;
         prefix >>= preShift;
-        uint64_t suffix = p[i].barcode & sufMask;
-        p[i].barcode = prefix + suffix;
-        o.write((char *) &p[i], sizeof(BUSData));
+        uint64_t suffix = bd.barcode & sufMask;
+        bd.barcode = prefix + suffix;
+        o.write((char *) &bd, sizeof(BUSData));
         ++nw;
       }
       /* Done going through BUSdata *p. */
@@ -98,7 +90,6 @@ void bustools_linker(Bustools_opt &opt) {
     
   } while (++infn != opt.files.end());
 
-  delete[] p; p = nullptr;
   of.close();
 
   std::cerr << "Read in " << nr << " BUS records, wrote " << nw << " BUS records" << std::endl;
@@ -22,6 +22,8 @@
 #include "bustools_inspect.h"
 #include "bustools_linker.h"
 #include "bustools_capture.h"
+#include "bustools_extract.h"
+#include "bustools_index.h"
 
 int my_mkdir(const char *path, mode_t mode) {
   #ifdef _WIN64
@@ -43,6 +45,57 @@ bool checkDirectoryExists(const std::string &fn) {
   return intStat == 0 && S_ISDIR(stFileInfo.st_mode);
 }
 
+// amount of memory given as a number of bytes with an optional M or G suffix
+size_t parseMemory(const std::string &s) {
+  size_t sh = 0;
+  int n = s.size();
+  if (n==0) {
+    return 0;
+  }
+  switch(s[n-1]) {
+    case 'm':
+    case 'M':
+      sh = 20;
+      n--;
+      break;
+    case 'g':
+    case 'G':
+      sh = 30;
+      n--;
+      break;
+    default:
+      sh = 0;
+      break;
+  }
+  size_t m = atoi(s.substr(0,n).c_str());
+  return m << sh;
+}
+
+void checkMaxMemory(Bustools_opt &opt) {
+  if (opt.max_memory < 1ULL<<26) {
+    if (opt.max_memory < 128) {
+      std::cerr << "Warning: low number supplied for maximum memory usage with out M og G suffix\n  interpreting this as " << opt.max_memory << "Gb" << std::endl;
+      opt.max_memory <<= 30;
+    } else {
+      std::cerr << "Warning: low number supplied for maximum memory, defaulting to 64Mb" << std::endl;
+      opt.max_memory = 1ULL<<26; // 64Mb is absolute minimum
+    }
+  }
+}
+
+// temporary files are named by appending to the prefix, a directory gets a prefix of its own
+void setTempPrefix(Bustools_opt &opt, const std::string &name) {
+  if (checkDirectoryExists(opt.temp_files)) {
+    // if it is a directory, create random file prefix
+    opt.temp_files += "/bus." + name + "." + std::to_string(getpid()) + ".";
+  } else {
+    int n = opt.temp_files.size();
+    if (opt.temp_files[n-1] != '.') {
+      opt.temp_files += '.';
+    }
+  }
+}
+
 
 
 
@@ -50,13 +103,19 @@ bool checkDirectoryExists(const std::string &fn) {
 
 void parse_ProgramOptions_sort(int argc, char **argv, Bustools_opt& opt) {
 
-  const char* opt_string = "t:o:m:T:p";
+  const char* opt_string = "t:o:m:T:F:zicpe:";
 
   static struct option long_options[] = {
     {"threads",         required_argument,  0, 't'},
     {"output",          required_argument,  0, 'o'},
     {"memory",          required_argument,  0, 'm'},
     {"temp",            required_argument,  0, 'T'},
+    {"fanin",           required_argument,  0, 'F'},
+    {"compress",        no_argument,        0, 'z'},
+    {"index",           no_argument,        0, 'i'},
+    {"columnar",        no_argument,        0, 'c'},
+    {"ecmap",           required_argument,  0, 'e'},
+    {"txnames",         required_argument,  0, 'N'},
     {"pipe",            no_argument, 0, 'p'},
     {0,                 0,                  0,  0 }
   };
@@ -64,9 +123,6 @@ void parse_ProgramOptions_sort(int argc, char **argv, Bustools_opt& opt) {
   int option_index = 0, c;
 
   while ((c = getopt_long(argc, argv, opt_string, long_options, &option_index)) != -1) {
-    std::string s;
-    size_t sh = 0;
-    int n = 0;
     switch (c) {
 
     case 't':
@@ -76,33 +132,31 @@ void parse_ProgramOptions_sort(int argc, char **argv, Bustools_opt& opt) {
       opt.output = optarg;
       break;
     case 'm':
-      s = optarg;
-      sh = 0;
-      n = s.size();
-      if (n==0) {
-        break;
-      }
-      switch(s[n-1]) {
-        case 'm':
-        case 'M':
-          sh = 20;
-          n--;
-          break;
-        case 'g':
-        case 'G':
-          sh = 30;
-          n--;
-          break;
-        default:
-          sh = 0;
-          break;
+      if (*optarg) {
+        opt.max_memory = parseMemory(optarg);
       }
-      opt.max_memory = atoi(s.substr(0,n).c_str());
-      opt.max_memory <<= sh;
       break;
     case 'T':
       opt.temp_files = optarg;
       break;
+    case 'F':
+      opt.max_fanin = atoi(optarg);
+      break;
+    case 'z':
+      opt.compress_temp = true;
+      break;
+    case 'i':
+      opt.sort_index = true;
+      break;
+    case 'c':
+      opt.sort_columnar = true;
+      break;
+    case 'e':
+      opt.count_ecs = optarg;
+      break;
+    case 'N':
+      opt.count_txp = optarg;
+      break;
     case 'p':
       opt.stream_out = true;
       break;
@@ -217,6 +271,13 @@ void parse_ProgramOptions_count(int argc, char **argv, Bustools_opt& opt) {
     {"txnames",          required_argument,  0, 't'},
     {"genecounts", no_argument, &gene_flag, 1},
     {"multimapping", no_argument, 0, 'm'},
+    {"threads",         required_argument,  0, 'T'},
+    {"binary",          no_argument,        0, 'B'},
+    {"unsorted",        no_argument,        0, 'U'},
+    {"memory",          required_argument,  0, 'M'},
+    {"temp",            required_argument,  0, 'P'},
+    {"tcc-genecounts",  no_argument,        0, 'C'},
+    {"umi-correct",     no_argument,        0, 'R'},
     {0,                 0,                  0,  0 }
   };
 
@@ -240,6 +301,29 @@ void parse_ProgramOptions_count(int argc, char **argv, Bustools_opt& opt) {
     case 'm':
       opt.count_gene_multimapping = true;
       break;
+    case 'T':
+      opt.threads = atoi(optarg);
+      break;
+    case 'B':
+      opt.count_binary = true;
+      break;
+    case 'U':
+      opt.count_unsorted = true;
+      break;
+    case 'M':
+      if (*optarg) {
+        opt.max_memory = parseMemory(optarg);
+      }
+      break;
+    case 'P':
+      opt.temp_files = optarg;
+      break;
+    case 'C':
+      opt.count_tcc_and_genes = true;
+      break;
+    case 'R':
+      opt.count_umi_correct = true;
+      break;
     default:
       break;
     }
@@ -495,6 +579,75 @@ void parse_ProgramOptions_linker(int argc, char **argv, Bustools_opt &opt) {
 }
 
 
+void parse_ProgramOptions_extract(int argc, char **argv, Bustools_opt &opt) {
+  const char *opt_string = "o:b:p";
+
+  static struct option long_options[] = {
+    {"output", required_argument, 0, 'o'},
+    {"barcodes", required_argument, 0, 'b'},
+    {"pipe", no_argument, 0, 'p'},
+    {0, 0, 0, 0}
+  };
+
+  int option_index = 0, c;
+
+  while ((c = getopt_long(argc, argv, opt_string, long_options, &option_index)) != -1) {
+    switch (c) {
+      case 'o':
+        opt.output = optarg;
+        break;
+      case 'b':
+        opt.capture = optarg;
+        break;
+      case 'p':
+        opt.stream_out = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  /* All other argumuments are sorted BUS files. */
+  while (optind < argc) opt.files.push_back(argv[optind++]);
+  
+  if (opt.files.size() == 1 && opt.files[0] == "-") {
+    opt.stream_in = true;
+  }
+}
+
+void parse_ProgramOptions_index(int argc, char **argv, Bustools_opt &opt) {
+  const char *opt_string = "o:e:t:g:";
+
+  static struct option long_options[] = {
+    {"output", required_argument, 0, 'o'},
+    {"ecmap", required_argument, 0, 'e'},
+    {"txnames", required_argument, 0, 't'},
+    {"genemap", required_argument, 0, 'g'},
+    {0, 0, 0, 0}
+  };
+
+  int option_index = 0, c;
+
+  while ((c = getopt_long(argc, argv, opt_string, long_options, &option_index)) != -1) {
+    switch (c) {
+      case 'o':
+        opt.output = optarg;
+        break;
+      case 'e':
+        opt.count_ecs = optarg;
+        break;
+      case 't':
+        opt.count_txp = optarg;
+        break;
+      case 'g':
+        opt.count_genes = optarg;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
 
 bool check_ProgramOptions_sort(Bustools_opt& opt) {
 
@@ -516,34 +669,40 @@ bool check_ProgramOptions_sort(Bustools_opt& opt) {
     ret = false;
   } 
 
-  if (opt.max_memory < 1ULL<<26) {
-    if (opt.max_memory < 128) {
-      std::cerr << "Warning: low number supplied for maximum memory usage with out M og G suffix\n  interpreting this as " << opt.max_memory << "Gb" << std::endl;
-      opt.max_memory <<= 30;
-    } else {
-      std::cerr << "Warning: low number supplied for maximum memory, defaulting to 64Mb" << std::endl;
-      opt.max_memory = 1ULL<<26; // 64Mb is absolute minimum
-    }
+  if (opt.stream_out && opt.sort_index) {
+    std::cerr << "Error: cannot write an index when writing to standard output" << std::endl;
+    ret = false;
+  }
+
+  if (opt.sort_columnar && opt.sort_index) {
+    std::cerr << "Error: cannot write an index for columnar output" << std::endl;
+    ret = false;
+  }
+
+  checkMaxMemory(opt);
+
+  if (opt.max_fanin < 2) {
+    std::cerr << "Error: maximum number of runs merged at once must be at least 2" << std::endl;
+    ret = false;
+  }
+
+  if (opt.count_ecs.size() && !checkFileExists(opt.count_ecs)) {
+    std::cerr << "Error: File not found " << opt.count_ecs << std::endl;
+    ret = false;
+  }
+
+  if (opt.count_txp.size() && !checkFileExists(opt.count_txp)) {
+    std::cerr << "Error: File not found " << opt.count_txp << std::endl;
+    ret = false;
   }
 
   if (opt.temp_files.empty()) {
-    if (opt.stream_out) {
-      std::cerr << "Error: temporary location -T must be set when using streaming output" << std::endl;
-      ret = false;      
-    } else {
+    // with streaming output and no -T the input has to fit in memory, this is checked when sorting
+    if (!opt.stream_out) {
       opt.temp_files = opt.output + ".";
     }
   } else {
-    
-    if (checkDirectoryExists(opt.temp_files)) {
-      // if it is a directory, create random file prefix
-      opt.temp_files += "/bus.sort." + std::to_string(getpid()) + ".";
-    } else {
-      int n = opt.temp_files.size();
-      if (opt.temp_files[n-1] != '.') {
-        opt.temp_files += '.';
-      }
-    }
+    setTempPrefix(opt, "sort");
   }
 
   if (opt.files.size() == 0) {
@@ -671,7 +830,10 @@ bool check_ProgramOptions_capture(Bustools_opt& opt) {
 
   if (opt.type == CAPTURE_TX) {
     if (opt.count_ecs.size() == 0) {
-      std::cerr << "Error: missing equialence class mapping file" << std::endl;
+      if (opt.stream_in) {
+        std::cerr << "Error: missing equialence class mapping file" << std::endl;
+        ret = false;
+      }
     } else {
       if (!checkFileExists(opt.count_ecs)) {
         std::cerr << "Error: File not found " << opt.count_ecs << std::endl;
@@ -680,7 +842,10 @@ bool check_ProgramOptions_capture(Bustools_opt& opt) {
     }
 
     if (opt.count_txp.size() == 0) {
-      std::cerr << "Error: missing transcript name file" << std::endl;
+      if (opt.stream_in && !isECIndex(opt.count_ecs)) {
+        std::cerr << "Error: missing transcript name file" << std::endl;
+        ret = false;
+      }
     } else {
       if (!checkFileExists(opt.count_txp)) {
         std::cerr << "Error: File not found " << opt.count_txp << std::endl;
@@ -749,6 +914,17 @@ bool check_ProgramOptions_correct(Bustools_opt& opt) {
 bool check_ProgramOptions_count(Bustools_opt& opt) {
   bool ret = true;
 
+  size_t max_threads = std::thread::hardware_concurrency();
+
+  if (opt.threads <= 0) {
+    std::cerr << "Error: Number of threads cannot be less than or equal to 0" << std::endl;
+    ret = false;
+  } else if ((size_t) opt.threads > max_threads) {
+    std::cerr << "Warning: Number of threads cannot be greater than or equal to " << max_threads 
+    << ". Setting number of threads to " << max_threads << std::endl;
+    opt.threads = max_threads;
+  }
+
   // check for output directory
   if (opt.output.empty()) {
     std::cerr << "Error: Missing output directory" << std::endl;
@@ -765,7 +941,18 @@ bool check_ProgramOptions_count(Bustools_opt& opt) {
     }
   }
 
-  
+  if (opt.count_unsorted) {
+    checkMaxMemory(opt);
+    // spill files left by another run must not be counted, so the prefix is unique to the process
+    if (opt.temp_files.empty()) {
+      opt.temp_files = opt.output;
+    }
+    bool temp_dir = checkDirectoryExists(opt.temp_files);
+    setTempPrefix(opt, "count");
+    if (!temp_dir) {
+      opt.temp_files += "count." + std::to_string(getpid()) + ".";
+    }
+  }
 
   if (opt.files.size() == 0) {
     std::cerr << "Error: Missing BUS input files" << std::endl;
@@ -782,8 +969,10 @@ bool check_ProgramOptions_count(Bustools_opt& opt) {
   }
 
   if (opt.count_genes.size() == 0) {
-    std::cerr << "Error: missing gene mapping file" << std::endl;
-    ret = false;
+    if (!isECIndex(opt.count_ecs)) {
+      std::cerr << "Error: missing gene mapping file" << std::endl;
+      ret = false;
+    }
   } else {
     if (!checkFileExists(opt.count_genes)) {
       std::cerr << "Error: File not found " << opt.count_genes << std::endl;
@@ -792,8 +981,10 @@ bool check_ProgramOptions_count(Bustools_opt& opt) {
   }
 
   if (opt.count_ecs.size() == 0) {
-    std::cerr << "Error: missing equialence class mapping file" << std::endl;
-    ret = false;
+    if (opt.stream_in) {
+      std::cerr << "Error: missing equialence class mapping file" << std::endl;
+      ret = false;
+    }
   } else {
     if (!checkFileExists(opt.count_ecs)) {
       std::cerr << "Error: File not found " << opt.count_ecs << std::endl;
@@ -802,8 +993,10 @@ bool check_ProgramOptions_count(Bustools_opt& opt) {
   }
 
   if (opt.count_txp.size() == 0) {
-    std::cerr << "Error: missing transcript name file" << std::endl;
-    ret = false;
+    if (opt.stream_in && !isECIndex(opt.count_ecs)) {
+      std::cerr << "Error: missing transcript name file" << std::endl;
+      ret = false;
+    }
   } else {
     if (!checkFileExists(opt.count_txp)) {
       std::cerr << "Error: File not found " << opt.count_txp << std::endl;
@@ -873,7 +1066,10 @@ bool check_ProgramOptions_project(Bustools_opt &opt) {
   }
 
   if (opt.count_genes.size() == 0) {
-    std::cerr << "Error: missing gene mapping file" << std::endl;
+    if (!isECIndex(opt.count_ecs)) {
+      std::cerr << "Error: missing gene mapping file" << std::endl;
+      ret = false;
+    }
   } else {
     if (!checkFileExists(opt.count_genes)) {
       std::cerr << "Error: File not found " << opt.count_genes << std::endl;
@@ -882,7 +1078,10 @@ bool check_ProgramOptions_project(Bustools_opt &opt) {
   }
   
   if (opt.count_ecs.size() == 0) {
-    std::cerr << "Error: missing equialence class mapping file" << std::endl;
+    if (opt.stream_in) {
+      std::cerr << "Error: missing equialence class mapping file" << std::endl;
+      ret = false;
+    }
   } else {
     if (!checkFileExists(opt.count_ecs)) {
       std::cerr << "Error: File not found " << opt.count_ecs << std::endl;
@@ -891,9 +1090,12 @@ bool check_ProgramOptions_project(Bustools_opt &opt) {
   }
   
   if (opt.count_txp.size() == 0) {
-    std::cerr << "Error: missing transcript name file" << std::endl;
+    if (opt.stream_in && !isECIndex(opt.count_ecs)) {
+      std::cerr << "Error: missing transcript name file" << std::endl;
+      ret = false;
+    }
   } else {
-    if (!checkFileExists(opt.count_genes)) {
+    if (!checkFileExists(opt.count_txp)) {
       std::cerr << "Error: File not found " << opt.count_txp << std::endl;
       ret = false;
     }
@@ -964,6 +1166,74 @@ bool check_ProgramOptions_linker(Bustools_opt &opt) {
   return ret;
 }
 
+bool check_ProgramOptions_extract(Bustools_opt &opt) {
+  bool ret = true;
+  
+  if (!opt.stream_out && opt.output.empty()) {
+    std::cerr << "Error: Missing output file" << std::endl;
+    ret = false;
+  } 
+
+  if (opt.capture.empty()) {
+    std::cerr << "Error: Missing barcode list" << std::endl;
+    ret = false;
+  } else if (!checkFileExists(opt.capture)) {
+    std::cerr << "Error: File not found, " << opt.capture << std::endl;
+    ret = false;
+  }
+
+  if (opt.files.size() == 0) {
+    std::cerr << "Error: Missing BUS input files" << std::endl;
+    ret = false;
+  } else {
+    if (!opt.stream_in) {
+      for (const auto& it : opt.files) {  
+        if (!checkFileExists(it)) {
+          std::cerr << "Error: File not found, " << it << std::endl;
+          ret = false;
+        }
+      }
+    }
+  }
+  
+  return ret;
+}
+
+bool check_ProgramOptions_index(Bustools_opt &opt) {
+  bool ret = true;
+
+  if (opt.output.empty()) {
+    std::cerr << "Error: Missing output file" << std::endl;
+    ret = false;
+  }
+
+  if (opt.count_ecs.empty()) {
+    std::cerr << "Error: missing equialence class mapping file" << std::endl;
+    ret = false;
+  } else if (!checkFileExists(opt.count_ecs)) {
+    std::cerr << "Error: File not found " << opt.count_ecs << std::endl;
+    ret = false;
+  }
+
+  if (opt.count_txp.empty()) {
+    std::cerr << "Error: missing transcript name file" << std::endl;
+    ret = false;
+  } else if (!checkFileExists(opt.count_txp)) {
+    std::cerr << "Error: File not found " << opt.count_txp << std::endl;
+    ret = false;
+  }
+
+  if (opt.count_genes.empty()) {
+    std::cerr << "Error: missing gene mapping file" << std::endl;
+    ret = false;
+  } else if (!checkFileExists(opt.count_genes)) {
+    std::cerr << "Error: File not found " << opt.count_genes << std::endl;
+    ret = false;
+  }
+
+  return ret;
+}
+
 
 void Bustools_Usage() {
   std::cout << "bustools " << BUSTOOLS_VERSION << std::endl << std::endl  
@@ -972,6 +1242,8 @@ void Bustools_Usage() {
   << "capture         Capture records from a BUS file" << std::endl
   << "correct         Error correct a BUS file" << std::endl
   << "count           Generate count matrices from a BUS file" << std::endl
+  << "extract         Extract the records of given barcodes from sorted BUS files" << std::endl
+  << "index           Compile the equivalence class, transcript and gene files into one index" << std::endl
   << "inspect         Produce a report summarizing a BUS file" << std::endl
   << "linker          Remove section of barcodes in BUS files" << std::endl
   //<< "merge           Merge bus files from same experiment" << std::endl
@@ -992,7 +1264,14 @@ void Bustools_sort_Usage() {
   << "-t, --threads         Number of threads to use" << std::endl
   << "-m, --memory          Maximum memory used" << std::endl
   << "-T, --temp            Location and prefix for temporary files " << std::endl
-  << "                      required if using -p, otherwise defaults to output" << std::endl 
+  << "                      required if using -p and the input does not fit in memory," << std::endl
+  << "                      otherwise defaults to output" << std::endl 
+  << "-F, --fanin           Maximum number of temporary files merged at once (default: 128)" << std::endl
+  << "-z, --compress        Compress temporary files" << std::endl
+  << "-i, --index           Write a block index of the output barcodes to <output>.idx" << std::endl
+  << "-c, --columnar        Write the output in the compressed columnar BUS format (version 2)" << std::endl
+  << "-e, --ecmap           File for mapping equivalence classes to transcripts, embedded in the output" << std::endl
+  << "    --txnames         File with names of transcripts, embedded in the output" << std::endl
   << "-o, --output          File for sorted output" << std::endl
   << "-p, --pipe            Write to standard output" << std::endl
   << std::endl;
@@ -1039,7 +1318,8 @@ void Bustools_correct_Usage() {
 }
 
 void Bustools_count_Usage() {
-  std::cout << "Usage: bustools count [options] sorted-bus-files" << std::endl << std::endl
+  std::cout << "Usage: bustools count [options] sorted-bus-files" << std::endl
+  << "       bustools count [options] --unsorted bus-files" << std::endl << std::endl
   << "Options: " << std::endl
   << "-o, --output          File for corrected bus output" << std::endl
   << "-g, --genemap         File for mapping transcripts to genes" << std::endl
@@ -1047,6 +1327,14 @@ void Bustools_count_Usage() {
   << "-t, --txnames         File with names of transcripts" << std::endl
   << "--genecounts          Aggregate counts to genes only" << std::endl
   << "-m, --multimapping    Include bus records that pseudoalign to multiple genes" << std::endl
+  << "    --tcc-genecounts  Write the TCC matrix and, to <output>.genes.mtx, the gene matrix" << std::endl
+  << "    --umi-correct     Merge UMIs of a barcode that are one mismatch apart" << std::endl
+  << "    --threads         Number of threads to use" << std::endl
+  << "    --binary          Write the matrix in binary to <output>.bin instead of <output>.mtx" << std::endl
+  << "    --unsorted        Count BUS files that are not sorted" << std::endl
+  << "    --memory          Maximum memory used for unsorted input" << std::endl
+  << "    --temp            Location and prefix for temporary files of unsorted input" << std::endl
+  << "                      (default: output)" << std::endl
   << std::endl;
 }
 
@@ -1088,6 +1376,25 @@ void Bustools_linker_Usage() {
     << std::endl;
 }
 
+void Bustools_index_Usage() {
+  std::cout << "Usage: bustools index [options]" << std::endl << std::endl
+    << "Options: " << std::endl
+    << "-o, --output          File for the index" << std::endl
+    << "-e, --ecmap           File for mapping equivalence classes to transcripts" << std::endl
+    << "-t, --txnames         File with names of transcripts" << std::endl
+    << "-g, --genemap         File for mapping transcripts to genes" << std::endl
+    << std::endl;
+}
+
+void Bustools_extract_Usage() {
+  std::cout << "Usage: bustools extract [options] sorted-bus-files" << std::endl << std::endl
+    << "Options: " << std::endl
+    << "-b, --barcodes        File with the barcodes to extract" << std::endl
+    << "-o, --output          File for extracted output" << std::endl
+    << "-p, --pipe            Write to standard output" << std::endl
+    << std::endl;
+}
+
 
 
 int main(int argc, char **argv) {
@@ -1132,7 +1439,10 @@ int main(int argc, char **argv) {
           parseHeader(inf, h);
           inf.close();
           
-          parseECs(infn + "/matrix.ec", h);
+          // the ECs embedded in the header are used if there are any
+          if (h.ecs.empty()) {
+            parseECs(infn + "/matrix.ec", h);
+          }
           vh.push_back(std::move(h));
         }
 
@@ -1143,7 +1453,7 @@ int main(int argc, char **argv) {
         //TODO: parse the transcripts file, check that they are identical and merge.
         oh.bclen = vh[0].bclen;
         oh.umilen = vh[0].umilen;
-        std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> ecmapinv;
+        ECSetMap ecmapinv;
         std::vector<std::vector<int32_t>> ectrans;        
         std::vector<int32_t> ctrans;
         
@@ -1152,7 +1462,7 @@ int main(int argc, char **argv) {
         for (int32_t ec = 0; ec < oh.ecs.size(); ec++) {
           ctrans.push_back(ec);
           const auto &v = oh.ecs[ec];
-          ecmapinv.insert({v, ec});
+          ecmapinv.insert(v, ec);
         }
         ectrans.push_back(std::move(ctrans));
         
@@ -1162,14 +1472,11 @@ int main(int argc, char **argv) {
           int j = -1;
           for (const auto &v : vh[i].ecs) {
             j++;
-            int32_t ec = -1;
-            auto it = ecmapinv.find(v);
-            if (it != ecmapinv.end()) {
-              ec = it->second;              
-            } else {
+            int32_t ec = ecmapinv.find(v);
+            if (ec == -1) {
               ec = ecmapinv.size();
               oh.ecs.push_back(v); // copy
-              ecmapinv.insert({v,ec});
+              ecmapinv.insert(v, ec);
             }
             ctrans.push_back(ec);
           }
@@ -1183,29 +1490,28 @@ int main(int argc, char **argv) {
 
 
         size_t N = 100000;
-        BUSData* p = new BUSData[N];
+        const BUSData* p = nullptr;
+        std::vector<BUSData> q(N);
         size_t nr = 0;
         for (int i = 0; i < opt.files.size(); i++) {
           // open busfile and parse header
           BUSHeader h;
           const auto &ctrans = ectrans[i];
-          std::ifstream inf((opt.files[i] + "/output.bus").c_str(), std::ios::binary);
-          parseHeader(inf, h);
+          BUSReader reader(opt.files[i] + "/output.bus", false, h, N);
           // now read all records and translate the ecs
           while (true) {
-            inf.read((char*)p, N*sizeof(BUSData));
-            size_t rc = inf.gcount() / sizeof(BUSData);
+            size_t rc = reader.read(p);
             if (rc == 0) {
               break;
             }
             nr += rc;
             for (size_t i = 0; i < rc; i++) {
-              auto &b = p[i];
+              auto &b = q[i];
+              b = p[i];
               b.ec = ctrans[b.ec]; // modify the ec              
             }
-            outf.write((char*)p, rc*sizeof(BUSData));
+            outf.write((char*)q.data(), rc*sizeof(BUSData));
           }
-          inf.close();
         }
         outf.close();
       } else {
@@ -1223,7 +1529,7 @@ int main(int argc, char **argv) {
         BUSHeader h;
         size_t nr = 0;
         size_t N = 100000;
-        BUSData* p = new BUSData[N];
+        const BUSData* p = nullptr;
 
         std::streambuf *buf = nullptr;
         std::ofstream of;
@@ -1234,40 +1540,30 @@ int main(int argc, char **argv) {
         } else {
           buf = std::cout.rdbuf();
         }
-        std::ostream o(buf);
+        std::ostream os(buf);
+        TextWriter o(&os);
 
 
         char magic[4];      
         uint32_t version = 0;
         for (const auto& infn : opt.files) {          
-          std::streambuf *inbuf;
-          std::ifstream inf;
-          if (!opt.stream_in) {
-            inf.open(infn.c_str(), std::ios::binary);
-            inbuf = inf.rdbuf();
-          } else {
-            inbuf = std::cin.rdbuf();
-          }
-          std::istream in(inbuf);
-
-
-          parseHeader(in, h);
+          BUSReader reader(infn, opt.stream_in, h, N);
           uint32_t bclen = h.bclen;
           uint32_t umilen = h.umilen;
           int rc = 0;
           while (true) {
-            in.read((char*)p, N*sizeof(BUSData));
-            size_t rc = in.gcount() / sizeof(BUSData);
+            size_t rc = reader.read(p);
             if (rc == 0) {
               break;
             }
             nr += rc;
             for (size_t i = 0; i < rc; i++) {
-              o << binaryToString(p[i].barcode, bclen) << "\t" << binaryToString(p[i].UMI,umilen) << "\t" << p[i].ec << "\t" << p[i].count << "\n";        
+              o.writeSequence(p[i].barcode, bclen).put('\t').writeSequence(p[i].UMI, umilen).put('\t');
+              o.writeInt(p[i].ec).put('\t').writeUInt(p[i].count).put('\n');
             }
           }
         }
-        delete[] p; p = nullptr;
+        o.flush();
         if (!opt.stream_out) {
           of.close();
         }
@@ -1290,7 +1586,7 @@ int main(int argc, char **argv) {
         BUSHeader h;
         size_t nr = 0;
         size_t N = 100000;
-        BUSData* p = new BUSData[N];
+        const BUSData* p = nullptr;
         char magic[4];      
         uint32_t version = 0;
         size_t stat_white = 0;
@@ -1367,16 +1663,7 @@ int main(int argc, char **argv) {
         nr = 0;
         BUSData bd;
         for (const auto& infn : opt.files) { 
-          std::streambuf *inbuf;
-          std::ifstream inf;
-          if (!opt.stream_in) {
-            inf.open(infn.c_str(), std::ios::binary);
-            inbuf = inf.rdbuf();
-          } else {
-            inbuf = std::cin.rdbuf();
-          }
-          std::istream in(inbuf);          
-          parseHeader(in, h);
+          BUSReader reader(infn, opt.stream_in, h, N);
 
           if (!outheader_written) {
             writeHeader(bus_out, h);
@@ -1399,8 +1686,7 @@ int main(int argc, char **argv) {
 
           int rc = 0;
           while (true) {
-            in.read((char*)p, N*sizeof(BUSData));
-            size_t rc = in.gcount() / sizeof(BUSData);
+            size_t rc = reader.read(p);
             if (rc == 0) {
               break;
             }
@@ -1434,8 +1720,6 @@ int main(int argc, char **argv) {
         if (!opt.stream_out) {
           busf_out.close();
         }
-
-        delete[] p; p = nullptr;
       } else {
         Bustools_dump_Usage();
         exit(1);
@@ -1539,6 +1823,30 @@ int main(int argc, char **argv) {
         Bustools_linker_Usage();
         exit(1);
       }
+    } else if (cmd == "extract") {
+      if (disp_help) {
+        Bustools_extract_Usage();
+        exit(0);
+      }
+      parse_ProgramOptions_extract(argc-1, argv+1, opt);
+      if (check_ProgramOptions_extract(opt)) { //Program options are valid
+        bustools_extract(opt);
+      } else {
+        Bustools_extract_Usage();
+        exit(1);
+      }
+    } else if (cmd == "index") {
+      if (disp_help) {
+        Bustools_index_Usage();
+        exit(0);
+      }
+      parse_ProgramOptions_index(argc-1, argv+1, opt);
+      if (check_ProgramOptions_index(opt)) { //Program options are valid
+        bustools_index(opt);
+      } else {
+        Bustools_index_Usage();
+        exit(1);
+      }
     } else {
       std::cerr << "Error: invalid command " << cmd << std::endl;
       Bustools_Usage();      
@@ -12,31 +12,20 @@ void bustools_project(Bustools_opt &opt) {
   std::ofstream of;
 
   /* Read and parse equivalence class files. */
-  std::unordered_map<std::string, int32_t> txnames;
-  parseTranscripts(opt.count_txp, txnames);
-
-  std::vector<int32_t> genemap(txnames.size(), -1);
-  std::unordered_map<std::string, int32_t> genenames;
-  parseGenes(opt.count_genes, txnames, genemap, genenames);
-  std::vector<std::string> genenamesinv(genenames.size(), "");
-  for (const auto &gene : genenames) {
-    genenamesinv[gene.second] = gene.first;
+  ECIndex index;
+  if (!loadECIndex(opt.count_ecs, opt.count_txp, opt.count_genes, opt.stream_in ? "" : opt.files[0], index)) {
+    std::cerr << "Error: missing equivalence classes or transcript names, use -e and -t or a BUS file that embeds them" << std::endl;
+    exit(1);
   }
+  std::vector<std::string> genenamesinv = std::move(index.genes);
+  SetTable ec2genes = std::move(index.ec2genes);
 
-  std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> ecmapinv;
-  std::vector<std::vector<int32_t>> ecmap;
-  parseECs(opt.count_ecs, h);
-  ecmap = std::move(h.ecs);
-  ecmapinv.reserve(ecmap.size());
-  for (int32_t ec = 0; ec < ecmap.size(); ec++) {
-    ecmapinv.insert({ecmap[ec], ec});
+  std::vector<std::vector<int32_t>> geneEc2genes;
+  geneEc2genes.reserve(ec2genes.size());
+  for (auto g : ec2genes) {
+    geneEc2genes.emplace_back(g.begin(), g.end());
   }
-
-  std::vector<std::vector<int32_t>> ec2genes;        
-  create_ec2genes(ecmap, genemap, ec2genes);
-
-  std::vector<std::vector<int32_t>> geneEc2genes = ec2genes;
-  std::unordered_map<std::vector<int32_t>, int32_t, SortedVectorHasher> geneEc2genesinv;
+  ECSetMap geneEc2genesinv;
   std::sort(geneEc2genes.begin(), geneEc2genes.end());
   auto firstNonempty = geneEc2genes.begin();
   while (firstNonempty->size() == 0 && firstNonempty != geneEc2genes.end()) {
@@ -45,13 +34,13 @@ void bustools_project(Bustools_opt &opt) {
   geneEc2genes.erase(geneEc2genes.begin(), firstNonempty);
   geneEc2genes.erase(std::unique(geneEc2genes.begin(), geneEc2genes.end()), geneEc2genes.end());
   for (int32_t ec = 0; ec < geneEc2genes.size(); ++ec) {
-    geneEc2genesinv.insert({geneEc2genes[ec], ec});
+    geneEc2genesinv.insert(geneEc2genes[ec], ec);
   }
-  geneEc2genesinv.insert({{}, -1});
 
+  // ECs without genes are not in geneEc2genesinv and map to -1
   std::vector<int32_t> txEc2geneEc;
-  for (const auto &txEc : ec2genes) {
-    txEc2geneEc.push_back(geneEc2genesinv.at(txEc));
+  for (auto txEc : ec2genes) {
+    txEc2geneEc.push_back(geneEc2genesinv.find(txEc));
   }
   
 
@@ -87,38 +76,30 @@ void bustools_project(Bustools_opt &opt) {
   }
   std::ostream o(buf);
 
-  std::streambuf *inbuf;
-  std::ifstream inf;
-  if (!opt.stream_in) {
-    inf.open(opt.files[0].c_str(), std::ios::binary);
-    inbuf = inf.rdbuf();
-  } else {
-    inbuf = std::cin.rdbuf();
-  }
-  std::istream in(inbuf);
-  parseHeader(in, h);
+  BUSReader reader(opt.files[0], opt.stream_in, h);
 
   h.transcripts.clear();
   for (const auto & gene : genenamesinv) {
     h.transcripts.emplace_back(gene);
   }
 
-  h.ecs = geneEc2genes;
+  h.ecs.clear();
+  for (const auto &geneEc : geneEc2genes) {
+    h.ecs.push_back(geneEc);
+  }
 
   writeHeader(o, h);
  
   /* Process and output records. */
   size_t nr = 0;
   size_t nw = 0;
-  size_t N = 100000;
-  BUSData *p = new BUSData[N];
+  const BUSData *p = nullptr;
   BUSData *currRec = new BUSData;
   // Gene EC --> counts for current barcode/UMI pair
   std::unordered_map<uint32_t, uint32_t> counts;
   
   while (true) {
-    in.read((char*) p, N * sizeof(BUSData));
-    size_t rc = in.gcount() / sizeof(BUSData);
+    size_t rc = reader.read(p);
     if (rc == 0) {
       break;
     }
@@ -160,7 +141,6 @@ void bustools_project(Bustools_opt &opt) {
     o.write((char *) currRec, sizeof(BUSData));
   }
 
-  delete[] p; p = nullptr;
   delete currRec; currRec = nullptr;
   of.close();
 
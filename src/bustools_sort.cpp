@@ -2,7 +2,8 @@
 #include <fstream>
 #include <cstring>
 #include <algorithm>
-#include <queue>
+#include <thread>
+#include <memory>
 
 #include "Common.hpp"
 #include "BUSData.h"
@@ -22,100 +23,681 @@ inline bool operator<(const BUSData& a, const BUSData &b) {
 };
 
 
-inline bool operator<(const std::pair<BUSData,int>& a, const std::pair<BUSData,int> &b) {
-  if (a.first.barcode == b.first.barcode) {
-      if (a.first.UMI == b.first.UMI) {
-        if (a.first.ec == b.first.ec) {
-          return a.second < b.second;
-        } else {
-          return a.first.ec < b.first.ec;
-        }
-      } else {
-        return a.first.UMI < b.first.UMI;
-      } 
-    } else { 
-      return a.first.barcode < b.first.barcode;
+// digit d of the sort key, digits 0-3 are ec, 4-11 are UMI and 12-19 are barcode, least significant first.
+// ec is signed so its sign bit is flipped.
+inline uint32_t radix_digit(const BUSData &b, int d) {
+  if (d < 4) {
+    return ((((uint32_t) b.ec) ^ 0x80000000U) >> (8*d)) & 0xFF;
+  } else if (d < 12) {
+    return (b.UMI >> (8*(d-4))) & 0xFF;
+  } else {
+    return (b.barcode >> (8*(d-12))) & 0xFF;
+  }
+}
+
+template <typename KeyFn>
+static void radix_pass(const BUSData *src, BUSData *dst, size_t n, const size_t *count, KeyFn key) {
+  size_t offset[256];
+  size_t s = 0;
+  for (int i = 0; i < 256; i++) {
+    offset[i] = s;
+    s += count[i];
+  }
+  for (size_t i = 0; i < n; i++) {
+    dst[offset[key(src[i])]++] = src[i];
+  }
+}
+
+// byte-wise LSD radix sort of src[0..n) skipping digits that are constant, returns src or dst
+static BUSData* radix_sort_lsd(BUSData *src, BUSData *dst, size_t n) {
+  const int D = 20;
+  size_t hist[D*256];
+  std::memset(hist, 0, sizeof(hist));
+  for (size_t i = 0; i < n; i++) {
+    const auto &b = src[i];
+    uint32_t ec = ((uint32_t) b.ec) ^ 0x80000000U;
+    for (int d = 0; d < 4; d++) {
+      hist[(d << 8) | ((ec >> (8*d)) & 0xFF)]++;
     }
-  /*
-  if (a.first < b.first) {
-    return true;
-  } else if (b.first < a.first) {
-    return false;    
+    for (int d = 0; d < 8; d++) {
+      hist[((d+4) << 8) | ((b.UMI >> (8*d)) & 0xFF)]++;
+      hist[((d+12) << 8) | ((b.barcode >> (8*d)) & 0xFF)]++;
+    }
+  }
+
+  for (int d = 0; d < D; d++) {
+    const size_t *count = &hist[d << 8];
+    // a digit that is the same for every record does not change the order
+    bool constant = false;
+    for (int i = 0; i < 256; i++) {
+      if (count[i] == n) {
+        constant = true;
+        break;
+      }
+    }
+    if (constant) {
+      continue;
+    }
+
+    if (d < 4) {
+      int sh = 8*d;
+      radix_pass(src, dst, n, count, [sh](const BUSData &b) { return ((((uint32_t) b.ec) ^ 0x80000000U) >> sh) & 0xFF; });
+    } else if (d < 12) {
+      int sh = 8*(d-4);
+      radix_pass(src, dst, n, count, [sh](const BUSData &b) { return (b.UMI >> sh) & 0xFF; });
+    } else {
+      int sh = 8*(d-12);
+      radix_pass(src, dst, n, count, [sh](const BUSData &b) { return (b.barcode >> sh) & 0xFF; });
+    }
+    std::swap(src, dst);
+  }
+  return src;
+}
+
+// sorts src[0..n) into either src or dst, returns the buffer holding the result.
+// Large inputs are first split on their most significant varying digit so that
+// the LSD passes run on cache sized buckets.
+static BUSData* radix_sort_range(BUSData *src, BUSData *dst, size_t n) {
+  const size_t lsd_cutoff = 1ULL << 12;
+  if (n < 64) {
+    std::sort(src, src+n);
+    return src;
+  }
+  if (n <= lsd_cutoff) {
+    return radix_sort_lsd(src, dst, n);
+  }
+
+  uint64_t bc_or = 0, bc_and = ~0ULL, umi_or = 0, umi_and = ~0ULL;
+  uint32_t ec_or = 0, ec_and = ~0U;
+  for (size_t i = 0; i < n; i++) {
+    const auto &b = src[i];
+    uint32_t ec = ((uint32_t) b.ec) ^ 0x80000000U;
+    bc_or |= b.barcode; bc_and &= b.barcode;
+    umi_or |= b.UMI; umi_and &= b.UMI;
+    ec_or |= ec; ec_and &= ec;
+  }
+  uint64_t bc_diff = bc_or ^ bc_and, umi_diff = umi_or ^ umi_and;
+  uint32_t ec_diff = ec_or ^ ec_and;
+  int top = -1;
+  if (bc_diff != 0) {
+    top = 12 + (63 - __builtin_clzll(bc_diff)) / 8;
+  } else if (umi_diff != 0) {
+    top = 4 + (63 - __builtin_clzll(umi_diff)) / 8;
+  } else if (ec_diff != 0) {
+    top = (31 - __builtin_clz(ec_diff)) / 8;
   } else {
-    return a.second < b.second;
+    return src; // all keys are equal
+  }
+
+  size_t count[256], offset[257];
+  std::memset(count, 0, sizeof(count));
+  for (size_t i = 0; i < n; i++) {
+    count[radix_digit(src[i], top)]++;
+  }
+  offset[0] = 0;
+  for (int i = 0; i < 256; i++) {
+    offset[i+1] = offset[i] + count[i];
   }
-  */
+  radix_pass(src, dst, n, count, [top](const BUSData &b) { return radix_digit(b, top); });
+
+  for (int i = 0; i < 256; i++) {
+    size_t m = offset[i+1] - offset[i];
+    if (m == 0) {
+      continue;
+    }
+    BUSData *r = radix_sort_range(dst + offset[i], src + offset[i], m);
+    if (r != dst + offset[i]) {
+      std::memcpy(dst + offset[i], r, m*sizeof(BUSData));
+    }
+  }
+  return dst;
 }
 
-void bustools_sort(const Bustools_opt& opt) {
+BUSData* radix_sort(BUSData *p, size_t n, BUSData *tmp) {
+  return radix_sort_range(p, tmp, n);
+}
+
+// reads BUS records from all input files in order, as one stream
+struct SortInput {
+  const Bustools_opt &opt;
   BUSHeader h;
-  size_t N = opt.max_memory / sizeof(BUSData);
-  BUSData* p = new BUSData[N];
-  char magic[4];
-  uint32_t version = 0;
+  size_t file;
+  std::unique_ptr<BUSReader> reader;
+  const BUSData *cur;
+  size_t left;
 
-  int no_temp_files = 0;
+  SortInput(const Bustools_opt &opt) : opt(opt), file(0), cur(nullptr), left(0) {
+    open();
+  }
 
-  
-  size_t sc = 0;
-  int tmp_file_no = 0;
-  for (const auto& infn : opt.files) {
-    std::streambuf *inbuf;
-    std::ifstream inf;
-    if (!opt.stream_in) {
-      inf.open(infn.c_str(), std::ios::binary);
-      inbuf = inf.rdbuf();
-    } else {
-      inbuf = std::cin.rdbuf();
+  bool open() {
+    reader.reset();
+    if (file >= opt.files.size()) {
+      return false;
     }
-    std::istream in(inbuf);
+    reader.reset(new BUSReader(opt.files[file], opt.stream_in, h));
+    left = 0;
+    return true;
+  }
 
-    parseHeader(in, h);
+  // reads up to n records into p, returns the number read, 0 when all files are exhausted
+  size_t read(BUSData *p, size_t n) {
+    size_t rc = 0;
+    while (rc < n && file < opt.files.size()) {
+      if (left == 0) {
+        left = reader->read(cur);
+        if (left == 0) {
+          ++file;
+          open();
+          continue;
+        }
+      }
+      size_t c = std::min(left, n - rc);
+      std::memcpy(p + rc, cur, c*sizeof(BUSData));
+      cur += c;
+      left -= c;
+      rc += c;
+    }
+    return rc;
+  }
+};
 
-    int rc = 1;
-    
-    
-    
-    while (in.good()) {
-      // read as much as we can
-      in.read((char*)p, N*sizeof(BUSData));
-      size_t rc = in.gcount() / sizeof(BUSData);
-      if (rc == 0) {
-        break;
+// merges identical records of the sorted p[0..n) in place, returns the new number of records
+static size_t collapse_sorted(BUSData *p, size_t n) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; ) {
+    size_t j = i+1;
+    uint32_t c = p[i].count;
+    for (; j < n; j++) {
+      if (p[i].barcode != p[j].barcode || p[i].UMI != p[j].UMI || p[i].ec != p[j].ec) {
+          break;
       }
-      // now sort the data
-      std::sort(p,p+rc);
-      sc += rc;
-      
-
-      // write the output
-      std::ofstream outf(opt.temp_files + std::to_string(tmp_file_no), std::ios::binary);
-      writeHeader(outf, h);
-
-      for (size_t i = 0; i < rc; ) {
-        size_t j = i+1;
-        uint32_t c = p[i].count;
-        auto ec = p[i].ec;          
-        for (; j < rc; j++) {
-          if (p[i].barcode != p[j].barcode || p[i].UMI != p[j].UMI || p[i].ec != p[j].ec) {
-              break;
-          }
-          c += p[j].count;
+      c += p[j].count;
+    }
+    // merge identical things
+    p[k] = p[i];
+    p[k].count = c;
+    k++;
+    // increment
+    i = j;
+  }
+  return k;
+}
+
+// sorts p[0..n) using tmp as scratch and merges identical records, r is set to the buffer holding
+// the result, returns the number of records in it
+static size_t sort_collapse(BUSData *p, size_t n, BUSData *tmp, BUSData *&r) {
+  r = radix_sort(p, n, tmp);
+  return collapse_sorted(r, n);
+}
+
+// number of records between entries of the block index kept for every temporary run
+const size_t RUN_BLOCK = 1ULL << 14;
+
+// a temporary run with the first barcode and byte offset of every block of RUN_BLOCK records
+struct RunInfo {
+  std::string fn;
+  size_t n;
+  bool compressed;
+  std::vector<std::pair<uint64_t, uint64_t>> index;
+  RunInfo() : n(0), compressed(false) {}
+};
+
+// Compressed runs are a sequence of self contained blocks of up to RUN_BLOCK records, each a
+// uint32_t record count and byte size followed by the records. A record starts with a tag byte
+// saying which fields follow. Barcodes are delta coded, UMIs are delta coded within a barcode
+// and ecs within a barcode and UMI, otherwise they are stored as is. Counts other than 1 and
+// non-zero flags and pad follow as varints.
+enum RunTag : uint8_t {
+  TAG_NEW_BARCODE = 1,
+  TAG_NEW_UMI = 2,
+  TAG_COUNT = 4,
+  TAG_FLAGS = 8,
+  TAG_PAD = 16
+};
+
+static void encode_run_block(const BUSData *p, size_t n, std::vector<char> &b) {
+  BUSData prev;
+  for (size_t i = 0; i < n; i++) {
+    const BUSData &r = p[i];
+    uint8_t tag = 0;
+    if (i == 0 || r.barcode != prev.barcode) {
+      tag |= TAG_NEW_BARCODE | TAG_NEW_UMI;
+    } else if (r.UMI != prev.UMI) {
+      tag |= TAG_NEW_UMI;
+    }
+    if (r.count != 1) {
+      tag |= TAG_COUNT;
+    }
+    if (r.flags != 0) {
+      tag |= TAG_FLAGS;
+    }
+    if (r.pad != 0) {
+      tag |= TAG_PAD;
+    }
+    b.push_back((char) tag);
+    if (tag & TAG_NEW_BARCODE) {
+      putVarint(b, r.barcode - (i == 0 ? 0 : prev.barcode));
+      putVarint(b, r.UMI);
+    } else if (tag & TAG_NEW_UMI) {
+      putVarint(b, r.UMI - prev.UMI);
+    }
+    if (tag & TAG_NEW_UMI) {
+      // zigzag so that -1 is small
+      putVarint(b, zigzag(r.ec));
+    } else {
+      putVarint(b, (uint32_t) r.ec - (uint32_t) prev.ec);
+    }
+    if (tag & TAG_COUNT) {
+      putVarint(b, r.count);
+    }
+    if (tag & TAG_FLAGS) {
+      putVarint(b, r.flags);
+    }
+    if (tag & TAG_PAD) {
+      putVarint(b, r.pad);
+    }
+    prev = r;
+  }
+}
+
+static void decode_run_block(const char *b, size_t n, BUSData *p) {
+  BUSData prev;
+  for (size_t i = 0; i < n; i++) {
+    BUSData &r = p[i];
+    uint8_t tag = (uint8_t) *b++;
+    if (tag & TAG_NEW_BARCODE) {
+      r.barcode = (i == 0 ? 0 : prev.barcode) + getVarint(b);
+      r.UMI = getVarint(b);
+    } else {
+      r.barcode = prev.barcode;
+      r.UMI = (tag & TAG_NEW_UMI) ? prev.UMI + getVarint(b) : prev.UMI;
+    }
+    if (tag & TAG_NEW_UMI) {
+      r.ec = (int32_t) unzigzag(getVarint(b));
+    } else {
+      r.ec = (int32_t) ((uint32_t) prev.ec + (uint32_t) getVarint(b));
+    }
+    r.count = (tag & TAG_COUNT) ? (uint32_t) getVarint(b) : 1;
+    r.flags = (tag & TAG_FLAGS) ? (uint32_t) getVarint(b) : 0;
+    r.pad = (tag & TAG_PAD) ? (uint32_t) getVarint(b) : 0;
+    prev = r;
+  }
+}
+
+// writes sorted records to the output or to a temporary run, the run is indexed if info is set
+// and compressed if info->compressed is set. Records go through columnar instead if it is set.
+// finish() must be called after the last write.
+struct RunWriter {
+  std::ostream &out;
+  RunInfo *info;
+  BUSWriter *columnar;
+  size_t n;
+  uint64_t pos;
+  std::vector<BUSData> pending;
+  std::vector<char> enc;
+
+  RunWriter(std::ostream &out, RunInfo *info = nullptr, BUSWriter *columnar = nullptr)
+    : out(out), info(info), columnar(columnar), n(0), pos(0) {}
+
+  void write(const BUSData *p, size_t m) {
+    if (columnar != nullptr) {
+      columnar->write(p, m);
+      n += m;
+      return;
+    }
+    if (info != nullptr && info->compressed) {
+      for (size_t i = 0; i < m; ) {
+        size_t c = std::min(m - i, RUN_BLOCK - pending.size());
+        pending.insert(pending.end(), p + i, p + i + c);
+        i += c;
+        if (pending.size() == RUN_BLOCK) {
+          flush_block();
         }
-        // merge identical things
-        p[i].count = c;
-        outf.write((char*)(&(p[i])), sizeof(p[i]));
-        // increment
-        i = j;
       }
+      info->n += m;
+      n += m;
+      return;
+    }
+    if (info != nullptr) {
+      for (size_t i = (RUN_BLOCK - n % RUN_BLOCK) % RUN_BLOCK; i < m; i += RUN_BLOCK) {
+        info->index.push_back({p[i].barcode, (n + i)*sizeof(BUSData)});
+      }
+      info->n += m;
+    }
+    out.write((const char*) p, m*sizeof(BUSData));
+    n += m;
+  }
+
+  void finish() {
+    if (!pending.empty()) {
+      flush_block();
+    }
+  }
+
+ private:
+  void flush_block() {
+    enc.clear();
+    encode_run_block(pending.data(), pending.size(), enc);
+    uint32_t hdr[2] = {(uint32_t) pending.size(), (uint32_t) enc.size()};
+    info->index.push_back({pending[0].barcode, pos});
+    out.write((const char*) hdr, sizeof(hdr));
+    out.write(enc.data(), enc.size());
+    pos += sizeof(hdr) + enc.size();
+    pending.clear();
+  }
+};
+
+// copies sorted records into memory
+struct BufferWriter {
+  BUSData *dst;
+  size_t n;
+
+  BufferWriter(BUSData *dst) : dst(dst), n(0) {}
+
+  void write(const BUSData *p, size_t m) {
+    std::copy(p, p + m, dst + n);
+    n += m;
+  }
+};
+
+// a temporary file that cannot be written or read back in full would lose records, so give up
+static void check_temp_file(const std::ios &s, const std::string &fn, const char *what) {
+  if (!s) {
+    std::cerr << "Error: could not " << what << " temporary file " << fn << std::endl;
+    exit(1);
+  }
+}
+
+// sorts p[0..n) using tmp as scratch and writes it as the temporary run info.fn, runs have no header
+static void write_sorted_run(BUSData *p, size_t n, BUSData *tmp, RunInfo *info) {
+  BUSData *r = nullptr;
+  size_t m = sort_collapse(p, n, tmp, r);
+  std::ofstream outf(info->fn, std::ios::binary);
+  check_temp_file(outf, info->fn, "open");
+  RunWriter w(outf, info);
+  w.write(r, m);
+  w.finish();
+  outf.close();
+  check_temp_file(outf, info->fn, "write");
+}
+
+// a sorted run that is merged, either a chunk in memory or a temporary file read one block at a time.
+// A temporary run can be restricted to the barcodes in [lo, hi). Blocks of compressed runs need
+// room for RUN_BLOCK records.
+struct MergeSource {
+  const BUSData *cur;
+  const BUSData *end;
+  BUSData *block;
+  size_t block_size;
+  bool limited;
+  uint64_t hi;
+  bool compressed;
+  size_t left;
+  std::string fn;
+  std::vector<char> enc;
+  std::ifstream in;
+
+  MergeSource(const BUSData *p, size_t n) : cur(p), end(p+n), block(nullptr), block_size(0), limited(false), hi(0), compressed(false), left(0) {}
+  MergeSource(const RunInfo &run, BUSData *block, size_t block_size, uint64_t lo = 0, bool limited = false, uint64_t hi = 0)
+    : cur(block), end(block), block(block), block_size(block_size), limited(limited), hi(hi), compressed(run.compressed), left(run.n), fn(run.fn) {
+    in.open(fn.c_str(), std::ios::binary);
+    check_temp_file(in, fn, "open");
+    // start at the last block that begins before lo, every indexed block but the last holds RUN_BLOCK records
+    auto it = std::lower_bound(run.index.begin(), run.index.end(), lo,
+      [](const std::pair<uint64_t, uint64_t> &e, uint64_t bc) { return e.first < bc; });
+    if (it != run.index.begin()) {
+      in.seekg((it-1)->second);
+      left -= (it - 1 - run.index.begin())*RUN_BLOCK;
+    }
+    fill();
+    while (!done() && cur->barcode < lo) {
+      advance();
+    }
+    check_limit();
+  }
+
+  bool done() const {
+    return cur == end;
+  }
+
+  // reads the next block of the file, returns false when the run is exhausted. The run must hold
+  // exactly the number of records it was written with.
+  bool fill() {
+    if (block == nullptr || left == 0) {
+      return false;
+    }
+    cur = block;
+    end = block;
+    size_t m;
+    if (compressed) {
+      uint32_t hdr[2] = {0, 0};
+      in.read((char*) hdr, sizeof(hdr));
+      m = hdr[0];
+      if (!in || m == 0 || m > block_size || m > left) {
+        in.setstate(std::ios::failbit);
+      } else {
+        enc.resize(hdr[1]);
+        in.read(enc.data(), hdr[1]);
+      }
+      check_temp_file(in, fn, "read");
+      decode_run_block(enc.data(), m, block);
+    } else {
+      m = std::min(left, block_size);
+      in.read((char*) block, m*sizeof(BUSData));
+      check_temp_file(in, fn, "read");
+    }
+    end = block + m;
+    left -= m;
+    return true;
+  }
+
+  void check_limit() {
+    if (limited && cur != end && cur->barcode >= hi) {
+      cur = end;
+      block = nullptr;
+    }
+  }
+
+  void advance() {
+    if (++cur == end) {
+      fill();
+    }
+    check_limit();
+  }
+};
+
+inline bool same_key(const BUSData &a, const BUSData &b) {
+  return a.barcode == b.barcode && a.UMI == b.UMI && a.ec == b.ec;
+}
+
+// tournament tree of losers over k sources, tree[0] holds the index of the smallest head.
+// Ties go to the lower source index so the merge is stable.
+class LoserTree {
+ public:
+  LoserTree(std::vector<MergeSource> &src) : src(src), k(src.size()), tree(std::max<size_t>(k, 1)) {
+    if (k > 0) {
+      tree[0] = build(1);
+    }
+  }
+
+  bool empty() const {
+    return k == 0 || src[tree[0]].done();
+  }
+
+  const BUSData &top() const {
+    return *src[tree[0]].cur;
+  }
+
+  // advances the source holding the smallest head and replays its path to the root
+  void pop() {
+    int w = tree[0];
+    src[w].advance();
+    for (size_t node = (w + k) / 2; node >= 1; node /= 2) {
+      if (less(tree[node], w)) {
+        std::swap(tree[node], w);
+      }
+    }
+    tree[0] = w;
+  }
+
+ private:
+  std::vector<MergeSource> &src;
+  size_t k;
+  std::vector<int> tree;
 
-      outf.close();
-      tmp_file_no++;
+  bool less(int i, int j) const {
+    if (src[i].done()) {
+      return false;
+    }
+    if (src[j].done()) {
+      return true;
+    }
+    const BUSData &a = *src[i].cur, &b = *src[j].cur;
+    if (a.barcode != b.barcode) {
+      return a.barcode < b.barcode;
+    }
+    if (a.UMI != b.UMI) {
+      return a.UMI < b.UMI;
+    }
+    if (a.ec != b.ec) {
+      return a.ec < b.ec;
     }
+    return i < j;
   }
-  delete[] p;
-  p = nullptr;
 
+  int build(size_t node) {
+    if (node >= k) {
+      return node - k;
+    }
+    int l = build(2*node);
+    int r = build(2*node+1);
+    if (less(l, r)) {
+      tree[node] = r;
+      return l;
+    } else {
+      tree[node] = l;
+      return r;
+    }
+  }
+};
+
+// merges the sorted sources into out, identical records are collapsed and their counts summed.
+// obuf[0..osize) buffers the output, returns the number of records written
+template <typename Writer>
+static size_t merge_sources(std::vector<MergeSource> &src, Writer &out, BUSData *obuf, size_t osize) {
+  LoserTree lt(src);
+  size_t no = 0, nw = 0;
+  if (lt.empty()) {
+    return 0;
+  }
+  BUSData curr = lt.top();
+  lt.pop();
+  while (!lt.empty()) {
+    const BUSData &m = lt.top();
+    if (same_key(m, curr)) {
+      curr.count += m.count;
+    } else {
+      obuf[no++] = curr;
+      if (no == osize) {
+        out.write(obuf, no);
+        nw += no;
+        no = 0;
+      }
+      curr = m;
+    }
+    lt.pop();
+  }
+  obuf[no++] = curr;
+  out.write(obuf, no);
+  nw += no;
+  return nw;
+}
+
+// picks up to t-1 increasing barcodes that split the sampled barcodes into t ranges of about equal size
+static std::vector<uint64_t> pick_splitters(std::vector<uint64_t> &samples, size_t t) {
+  std::vector<uint64_t> splitters;
+  std::sort(samples.begin(), samples.end());
+  for (size_t i = 1; i < t && !samples.empty(); i++) {
+    uint64_t bc = samples[i*samples.size()/t];
+    if (splitters.empty() || bc > splitters.back()) {
+      splitters.push_back(bc);
+    }
+  }
+  return splitters;
+}
+
+void bustools_sort(const Bustools_opt& opt) {
+  // memory is split into the chunk being read, the chunk being sorted and scratch space for the radix sort
+  size_t N = opt.max_memory / (3*sizeof(BUSData));
+  BUSData* data = new BUSData[3*N];
+  BUSData* p = data;
+  BUSData* next = data + N;
+  BUSData* tmp = data + 2*N;
+  int nthreads = std::max(opt.threads, 1);
+  const size_t min_chunk = 1ULL << 16;
+
+  size_t sc = 0;
+  int tmp_file_no = 0;
+  std::vector<RunInfo> runs;
+  SortInput input(opt);
+  size_t rc = input.read(p, N);
+
+  // if the whole input fits in memory the sorted chunks are merged straight into the output
+  bool in_memory = rc < N;
+  std::vector<std::pair<BUSData*, size_t>> sorted_chunks;
+  if (!in_memory && opt.temp_files.empty()) {
+    std::cerr << "Error: input does not fit in memory, temporary location -T must be set when using streaming output" << std::endl;
+    exit(1);
+  }
+
+  while (rc > 0) {
+    size_t nt = std::min<size_t>(nthreads, (rc + min_chunk - 1) / min_chunk);
+    size_t chunk = (rc + nt - 1) / nt;
+    std::vector<std::thread> workers;
+
+    if (in_memory) {
+      sorted_chunks.resize(nt);
+      for (size_t t = 0; t < nt; t++) {
+        size_t b = t*chunk;
+        size_t e = std::min(rc, b + chunk);
+        workers.emplace_back([&sorted_chunks, p, tmp, b, e, t]() {
+          auto &c = sorted_chunks[t];
+          c.second = sort_collapse(p + b, e - b, tmp + b, c.first);
+        });
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+      sc += rc;
+      break;
+    }
+
+    // read the next chunk while this one is sorted
+    size_t next_rc = 0;
+    std::thread reader([&]() { next_rc = input.read(next, N); });
+
+    // each thread sorts and writes its own part of the chunk as a separate run
+    runs.resize(tmp_file_no + nt);
+    for (size_t t = 0; t < nt; t++) {
+      size_t b = t*chunk;
+      size_t e = std::min(rc, b + chunk);
+      RunInfo *info = &runs[tmp_file_no + t];
+      info->fn = opt.temp_files + std::to_string(tmp_file_no + t);
+      info->compressed = opt.compress_temp;
+      workers.emplace_back(write_sorted_run, p + b, e - b, tmp + b, info);
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+    reader.join();
+
+    sc += rc;
+    tmp_file_no += nt;
+    std::swap(p, next);
+    rc = next_rc;
+  }
+  BUSHeader &h = input.h;
 
   std::cerr << "Read in " << sc << " BUS records" << std::endl;
 
@@ -130,93 +712,235 @@ void bustools_sort(const Bustools_opt& opt) {
   }
   std::ostream busf_out(buf);
 
-  writeHeader(busf_out, h);
+  if (opt.sort_columnar) {
+    h.version = BUSFORMAT_VERSION_COLUMNAR;
+  }
+  // the equivalence classes and transcript names are embedded in the header of the output
+  if (!opt.count_ecs.empty()) {
+    h.ecs.clear();
+    parseECs(opt.count_ecs, h);
+  }
+  if (!opt.count_txp.empty()) {
+    std::unordered_map<std::string, int32_t> txnames;
+    parseTranscripts(opt.count_txp, txnames);
+    h.transcripts.assign(txnames.size(), BUSTranscript());
+    for (const auto &tx : txnames) {
+      h.transcripts[tx.second].name = tx.first;
+    }
+  }
+  writeHeader(busf_out, h, !opt.count_ecs.empty() || !opt.count_txp.empty());
+  // the output is indexed like a temporary run
+  RunInfo out_info;
+  uint64_t out_offset = opt.sort_index ? (uint64_t) busf_out.tellp() : 0;
+  BUSWriter columnar(busf_out);
+  RunWriter output(busf_out, opt.sort_index ? &out_info : nullptr, opt.sort_columnar ? &columnar : nullptr);
 
+  if (in_memory) {
+    // the final merge is split on barcodes into one range per thread
+    std::vector<uint64_t> samples;
+    if (nthreads > 1) {
+      for (const auto &c : sorted_chunks) {
+        for (size_t i = 0; i < c.second; i += RUN_BLOCK) {
+          samples.push_back(c.first[i].barcode);
+        }
+      }
+    }
+    auto splitters = pick_splitters(samples, nthreads);
+    size_t P = splitters.size() + 1;
 
-  // todo: skip writing to disk if it fits in memory
-  if (tmp_file_no == 1) {
-    size_t M = N / 8;
-    p = new BUSData[M];
-    std::ifstream in(opt.temp_files  + "0", std::ios::binary);
-    BUSHeader tmp;
-    parseHeader(in,tmp);
-    while (in.good()) {
-      // read as much as we can
-      in.read((char*)p, M*sizeof(BUSData));
-      size_t rc = in.gcount() / sizeof(BUSData);
-      if (rc == 0) {
-        break;
+    if (P == 1) {
+      // merge the sorted chunks, the chunk that is no longer being read is the output buffer
+      std::vector<MergeSource> src;
+      src.reserve(sorted_chunks.size());
+      for (const auto &c : sorted_chunks) {
+        src.emplace_back(c.first, c.second);
+      }
+      merge_sources(src, output, next, N);
+    } else {
+      // bounds[c][t] is where range t starts in chunk c, range t is merged into the free chunk
+      // starting at the number of records in earlier ranges
+      auto bc_less = [](const BUSData &b, uint64_t bc) { return b.barcode < bc; };
+      std::vector<std::vector<size_t>> bounds(sorted_chunks.size(), std::vector<size_t>(P+1, 0));
+      std::vector<size_t> offset(P+1, 0);
+      for (size_t c = 0; c < sorted_chunks.size(); c++) {
+        const BUSData *b = sorted_chunks[c].first;
+        size_t n = sorted_chunks[c].second;
+        for (size_t t = 1; t < P; t++) {
+          bounds[c][t] = std::lower_bound(b, b + n, splitters[t-1], bc_less) - b;
+        }
+        bounds[c][P] = n;
+        for (size_t t = 0; t < P; t++) {
+          offset[t+1] += bounds[c][t+1];
+        }
+      }
+
+      std::vector<size_t> written(P, 0);
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < P; t++) {
+        workers.emplace_back([&, t]() {
+          std::vector<MergeSource> src;
+          for (size_t c = 0; c < sorted_chunks.size(); c++) {
+            size_t b = bounds[c][t], e = bounds[c][t+1];
+            src.emplace_back(sorted_chunks[c].first + b, e - b);
+          }
+          std::vector<BUSData> obuf(std::min<size_t>(N, 1ULL << 16));
+          BufferWriter w(next + offset[t]);
+          written[t] = merge_sources(src, w, obuf.data(), obuf.size());
+        });
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+      for (size_t t = 0; t < P; t++) {
+        output.write(next + offset[t], written[t]);
       }
-      busf_out.write((char*)p,rc*sizeof(BUSData));
     }
-    in.close();
-    std::remove((opt.temp_files  + "0").c_str());
+    delete[] data;
+    data = nullptr;
   } else {
-    // TODO: test if replacing with k-way merge is better
-    // adapted from https://github.com/arq5x/kway-mergesort/blob/master/kwaymergesort.h
-    int k = tmp_file_no;
-    size_t M = N / (k);
-    //std::memset(p, 0, N*sizeof(BUSData));    
-    std::vector<std::ifstream> bf(k);
-    for (int i = 0; i < k; i++) {
-      bf[i].open((opt.temp_files + std::to_string(i)).c_str(), std::ios::binary);
-      BUSHeader tmp;
-      parseHeader(bf[i],tmp);
-    }
-
-    using TP = std::pair<BUSData, int>;
-    std::priority_queue<TP, std::vector<TP>, std::greater<TP>> pq;
-    BUSData t;
-    for (int i = 0; i < k; i++) {
-      bf[i].read((char*) &t, sizeof(t));
-      pq.push({t,i});
-    }
-
-    BUSData curr = pq.top().first;
-    curr.count = 0; // we'll count this again in the first loop
-    while (!pq.empty()) {
-      TP min = pq.top();
-      
-      pq.pop();
-      // process the data
-      BUSData &m = min.first;
-      int i = min.second;
-      if (m.barcode == curr.barcode && m.UMI == curr.UMI && m.ec == curr.ec) {
-        // same data, increase count
-        curr.count += m.count;
-      } else {
-        // new data let's output curr, new curr is m
-        busf_out.write((char*)&curr, sizeof(curr));
-        curr = m;
+    delete[] data;
+    data = nullptr;
+    p = nullptr;
+
+    // each run is read in blocks, the memory budget is shared by at most max_fanin runs and the output
+    // buffer so that the memory per reader does not depend on the number of runs
+    int nruns = tmp_file_no;
+    size_t fanin = std::max(opt.max_fanin, 2);
+    size_t k = std::min(runs.size(), fanin);
+    size_t M = std::min<size_t>(opt.max_memory / ((k+1)*sizeof(BUSData)), 1ULL << 20);
+    M = std::max<size_t>(M, opt.compress_temp ? RUN_BLOCK : 1);
+    std::vector<BUSData> blocks((k+1)*M);
+
+    auto merge_runs = [&](std::vector<RunInfo>::const_iterator first, std::vector<RunInfo>::const_iterator last, RunWriter &out) {
+      std::vector<MergeSource> src;
+      src.reserve(last - first);
+      for (auto it = first; it != last; ++it) {
+        src.emplace_back(*it, &blocks[src.size()*M], M);
       }
-      // read next from stream
-      if (bf[i].good()) {
-        bf[i].read((char*) &t, sizeof(t));
-        if (bf[i].gcount() > 0) {
-          pq.push({t,i});
+      merge_sources(src, out, &blocks[k*M], M);
+    };
+    auto remove_runs = [](std::vector<RunInfo>::const_iterator first, std::vector<RunInfo>::const_iterator last) {
+      // remove intermediary files
+      for (auto it = first; it != last; ++it) {
+        std::remove(it->fn.c_str());
+      }
+    };
+
+    // intermediate passes merge groups of runs until the rest can be merged at once
+    int passes = 1;
+    while (runs.size() > fanin) {
+      std::vector<RunInfo> merged;
+      for (size_t i = 0; i < runs.size(); i += fanin) {
+        size_t j = std::min(runs.size(), i + fanin);
+        if (j - i == 1) {
+          merged.push_back(runs[i]);
+          continue;
         }
+        merged.emplace_back();
+        RunInfo &info = merged.back();
+        info.fn = opt.temp_files + std::to_string(tmp_file_no++);
+        info.compressed = opt.compress_temp;
+        std::ofstream outf(info.fn, std::ios::binary);
+        check_temp_file(outf, info.fn, "open");
+        RunWriter w(outf, &info);
+        merge_runs(runs.begin() + i, runs.begin() + j, w);
+        w.finish();
+        outf.close();
+        check_temp_file(outf, info.fn, "write");
+        remove_runs(runs.begin() + i, runs.begin() + j);
       }
+      runs.swap(merged);
+      passes++;
     }
 
-    if (curr.count > 0) {
-      // write out remaining straggler
-      busf_out.write((char*) &curr, sizeof(curr));
-    }
-     
-    // remove intermediary files
-    for (int i = 0; i < k; i++) {
-      bf[i].close();
-      std::remove((opt.temp_files + std::to_string(i)).c_str());
+    // the final merge is split on barcodes into one range per thread, the first range is written
+    // to the output directly and the others to temporary segments that are appended in order.
+    // Every thread opens all runs, so there are only as many threads as keep that within max_fanin.
+    size_t final_threads = std::min<size_t>(nthreads, std::max<size_t>(fanin / std::max<size_t>(runs.size(), 1), 1));
+    std::vector<uint64_t> samples;
+    if (final_threads > 1) {
+      for (const auto &run : runs) {
+        for (const auto &e : run.index) {
+          samples.push_back(e.first);
+        }
+      }
     }
+    auto splitters = pick_splitters(samples, final_threads);
+    size_t P = splitters.size() + 1;
 
-    
+    if (P == 1) {
+      merge_runs(runs.begin(), runs.end(), output);
+    } else {
+      blocks.clear();
+      blocks.shrink_to_fit();
+      size_t MP = std::min<size_t>(opt.max_memory / (P*(k+1)*sizeof(BUSData)), 1ULL << 20);
+      MP = std::max<size_t>(MP, opt.compress_temp ? RUN_BLOCK : 1);
+      std::vector<BUSData> pblocks(P*(k+1)*MP);
+      std::vector<RunInfo> segments(P);
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < P; t++) {
+        if (t > 0) {
+          segments[t].fn = opt.temp_files + std::to_string(tmp_file_no++);
+        }
+        workers.emplace_back([&, t]() {
+          BUSData *pb = &pblocks[t*(k+1)*MP];
+          uint64_t lo = (t > 0) ? splitters[t-1] : 0;
+          bool limited = t+1 < P;
+          uint64_t hi = limited ? splitters[t] : 0;
+          std::vector<MergeSource> src;
+          src.reserve(runs.size());
+          for (const auto &run : runs) {
+            src.emplace_back(run, pb + src.size()*MP, MP, lo, limited, hi);
+          }
+          if (t == 0) {
+            merge_sources(src, output, pb + k*MP, MP);
+          } else {
+            std::ofstream outf(segments[t].fn, std::ios::binary);
+            check_temp_file(outf, segments[t].fn, "open");
+            RunWriter w(outf);
+            segments[t].n = merge_sources(src, w, pb + k*MP, MP);
+            outf.close();
+            check_temp_file(outf, segments[t].fn, "write");
+          }
+        });
+      }
+      for (auto &w : workers) {
+        w.join();
+      }
+      for (size_t t = 1; t < P; t++) {
+        std::ifstream in(segments[t].fn, std::ios::binary);
+        check_temp_file(in, segments[t].fn, "open");
+        BUSData *pb = pblocks.data();
+        for (size_t left = segments[t].n; left > 0; ) {
+          size_t rc = std::min(left, pblocks.size());
+          in.read((char*) pb, rc*sizeof(BUSData));
+          check_temp_file(in, segments[t].fn, "read");
+          output.write(pb, rc);
+          left -= rc;
+        }
+        in.close();
+      }
+      remove_runs(segments.begin() + 1, segments.end());
+    }
+    remove_runs(runs.begin(), runs.end());
+    std::cerr << "Merged " << nruns << " sorted runs in " << passes << " pass" << (passes > 1 ? "es" : "") << std::endl;
   }
 
+  columnar.close();
   if (!opt.stream_out) {
     of.close();    
   }
- 
 
+  if (opt.sort_index) {
+    BUSIndex index;
+    index.block_size = RUN_BLOCK;
+    index.offset = out_offset;
+    index.n = out_info.n;
+    for (const auto &e : out_info.index) {
+      index.barcodes.push_back(e.first);
+    }
+    writeIndex(opt.output, index);
+  }
 }
 
 void bustools_sort_orig(const Bustools_opt& opt) {
@@ -254,18 +978,12 @@ void bustools_sort_orig(const Bustools_opt& opt) {
   delete[] p; p = nullptr;
   std::cerr << "Read in " << b.size() << " BUS records" << std::endl;
 
-  // todo: replace with radix sort 
-  std::sort(b.begin(), b.end(), [&](const BUSData& a, const BUSData &b) 
-                                {
-                                    if (a.barcode == b.barcode) {
-                                      if (a.UMI == b.UMI) {
-                                        return a.ec < b.ec;
-                                      } else {
-                                        return a.UMI < b.UMI;
-                                      } 
-                                    } else { 
-                                      return a.barcode < b.barcode;
-                                    }});
+  {
+    std::vector<BUSData> tmp(b.size());
+    if (radix_sort(b.data(), b.size(), tmp.data()) != b.data()) {
+      b.swap(tmp);
+    }
+  }
   std::cerr << "All sorted" << std::endl;
 
 
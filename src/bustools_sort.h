@@ -1,4 +1,8 @@
 #include "Common.hpp"
+#include "BUSData.h"
+
+// sorts p[0..n) by barcode, UMI and ec using tmp[0..n) as scratch, returns the buffer holding the result
+BUSData* radix_sort(BUSData *p, size_t n, BUSData *tmp);
 
 void bustools_sort_orig(const Bustools_opt& opt);
 void bustools_sort(const Bustools_opt& opt);
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cmath>
 
 #include "Common.hpp"
 #include "BUSData.h"
@@ -13,20 +14,11 @@ void bustools_whitelist(Bustools_opt &opt) {
   BUSHeader h;
   size_t nr = 0;
   size_t N = 100000;
-  BUSData *p = new BUSData[N];
+  const BUSData *p = nullptr;
 
   std::ofstream of(opt.output);
-  std::ostream o(of.rdbuf());
-  std::streambuf *inbuf;
-  std::ifstream inf;
-  if (!opt.stream_in) {
-    inf.open(opt.files[0].c_str(), std::ios::binary);
-    inbuf = inf.rdbuf();
-  } else {
-    inbuf = std::cin.rdbuf();
-  }
-  std::istream in(inbuf);
-  parseHeader(in, h);
+  TextWriter o(&of);
+  BUSReader reader(opt.files[0], opt.stream_in, h, N);
 
   uint32_t bclen = h.bclen;
   size_t rc = 1; // Non-zero so that second while loop works when using custom threshold
@@ -46,8 +38,7 @@ void bustools_whitelist(Bustools_opt &opt) {
     std::vector<wl_Record> vec;
 
     while (true) { 
-      in.read((char*) p, N * sizeof(BUSData));
-      rc = in.gcount() / sizeof(BUSData);
+      rc = reader.read(p);
       if (rc == 0) {
         break;
       }
@@ -113,7 +104,7 @@ void bustools_whitelist(Bustools_opt &opt) {
     /* Process all the records we just went through. */
     for (const auto &rec : vec) {
       if (rec.count >= threshold) {
-        o << binaryToString(rec.barcode, bclen) << "\n";
+        o.writeSequence(rec.barcode, bclen).put('\n');
         ++wl_count;
       }
     }
@@ -123,8 +114,7 @@ void bustools_whitelist(Bustools_opt &opt) {
 
   /* Go through remainder of records. */
   while (rc) {
-    in.read((char*) p, N * sizeof(BUSData));
-    rc = in.gcount() / sizeof(BUSData);
+    rc = reader.read(p);
     if (rc == 0) {
       break;
     }
@@ -133,7 +123,7 @@ void bustools_whitelist(Bustools_opt &opt) {
     for (size_t i = 0; i < rc; i++) {
       if (curr_bc != p[i].barcode || bc_count == -1) {
         if (bc_count >= threshold) {
-          o << binaryToString(curr_bc, bclen) << "\n";
+          o.writeSequence(curr_bc, bclen).put('\n');
           ++wl_count;
         }
         bc_count = p[i].count;
@@ -148,11 +138,11 @@ void bustools_whitelist(Bustools_opt &opt) {
   /* Done reading BUS file. */
   
   if (bc_count >= threshold) {
-    o << binaryToString(curr_bc, bclen) << "\n";
+    o.writeSequence(curr_bc, bclen).put('\n');
     ++wl_count;
   }
 
-  delete[] p; p = nullptr;
+  o.flush();
   of.close();
   std::cerr << "Read in " << nr << " BUS records, wrote " << wl_count << " barcodes to whitelist with threshold " << threshold << std::endl;
 }